@@ -1 +1 @@
-clang -O0 -o endo main.c -lm
+clang -O0 -o endo main.c -lm -lpthread
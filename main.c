@@ -1,9 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #define STBI_ONLY_PNG
 #define STBI_NO_STDIO
@@ -17,6 +25,9 @@
 
 #define panic(...) do { dprintf(2, __VA_ARGS__); exit(1); } while (0);
 
+static bool verbose = true;
+#define trace(...) do { if (verbose) { printf(__VA_ARGS__); } } while (0)
+
 static void *emalloc(size_t size) {
 	void *ret = malloc(size);
 	if (ret == NULL) {
@@ -65,97 +76,5338 @@ static char *read_file(char *filename, size_t *file_size) {
 		panic("Failed to read file!\n");
 	}
 
-	*file_size = size;
-	return buffer;
+	close(fd);
+
+	*file_size = size;
+	return buffer;
+}
+
+
+#define get_rna_seq(rna) (((uint64_t)((rna)[6])) << 48 | ((uint64_t)((rna)[5])) << 40 | ((uint64_t)((rna)[4])) << 32 | ((uint64_t)((rna)[3])) << 24 | ((uint64_t)((rna)[2])) << 16 | ((uint64_t)((rna)[1])) << 8 | ((uint64_t)((rna)[0])))
+
+#define max(x, y) (((x) > (y)) ? (x) : (y))
+#define min(x, y) (((x) < (y)) ? (x) : (y))
+
+typedef enum {
+	ADD_COLOR_BLACK       = get_rna_seq("PIPIIIC"),
+	ADD_COLOR_RED         = get_rna_seq("PIPIIIP"),
+	ADD_COLOR_GREEN       = get_rna_seq("PIPIICC"),
+	ADD_COLOR_YELLOW      = get_rna_seq("PIPIICF"),
+	ADD_COLOR_BLUE        = get_rna_seq("PIPIICP"),
+	ADD_COLOR_MAGENTA     = get_rna_seq("PIPIIFC"),
+	ADD_COLOR_CYAN        = get_rna_seq("PIPIIFF"),
+	ADD_COLOR_WHITE       = get_rna_seq("PIPIIPC"),
+	ADD_ALPHA_TRANSPARENT = get_rna_seq("PIPIIPF"),
+	ADD_ALPHA_OPAQUE      = get_rna_seq("PIPIIPP"),
+	CLEAR_BUCKET          = get_rna_seq("PIIPICP"),
+	MOVE                  = get_rna_seq("PIIIIIP"),
+	TURN_CCLOCKWISE       = get_rna_seq("PCCCCCP"),
+	TURN_CLOCKWISE        = get_rna_seq("PFFFFFP"),
+	MARK        		  = get_rna_seq("PCCIFFP"),
+	LINE        		  = get_rna_seq("PFFICCP"),
+	FILL        		  = get_rna_seq("PIIPIIP"),
+	ADD_BITMAP       	  = get_rna_seq("PCCPFFP"),
+	COMPOSE       	      = get_rna_seq("PFFPCCP"),
+	CLIP       	      	  = get_rna_seq("PFFICCF"),
+} inst_t;
+
+static char *get_inst_name(inst_t inst) {
+	switch (inst) {
+		case ADD_COLOR_BLACK:       return "Add Color: Black";
+		case ADD_COLOR_RED:         return "Add Color: Red";
+		case ADD_COLOR_GREEN:       return "Add Color: Green";
+		case ADD_COLOR_YELLOW:      return "Add Color: Yellow";
+		case ADD_COLOR_BLUE:        return "Add Color: Blue";
+		case ADD_COLOR_MAGENTA:     return "Add Color: Magenta";
+		case ADD_COLOR_CYAN:        return "Add Color: Cyan";
+		case ADD_COLOR_WHITE:       return "Add Color: White";
+		case ADD_ALPHA_TRANSPARENT: return "Add Alpha: Transparent";
+		case ADD_ALPHA_OPAQUE:      return "Add Alpha: Opaque";
+		case CLEAR_BUCKET:          return "Clear Bucket";
+		case MOVE:                  return "Move";
+		case TURN_CCLOCKWISE:       return "Turn Counter-Clockwise";
+		case TURN_CLOCKWISE:        return "Turn Clockwise";
+		case MARK:                  return "Set Mark";
+		case LINE:                  return "Draw Line";
+		case FILL:                  return "Fill";
+		case ADD_BITMAP:            return "Add Bitmap";
+		case COMPOSE:               return "Compose";
+		case CLIP:                  return "Clip";
+		default:                    return NULL;
+	}
+}
+
+// Clockwise, so turning is adding or subtracting one
+typedef enum {
+	DIR_N,
+	DIR_E,
+	DIR_S,
+	DIR_W,
+} dir_t;
+
+typedef enum {
+	COLOR_RGB,
+	COLOR_ALPHA
+} color_kind_t;
+
+typedef struct {
+	union {
+		struct {
+			uint8_t r;
+			uint8_t g;
+			uint8_t b;
+			uint8_t a;
+		};
+		uint32_t c;
+	};
+} color_t;
+
+typedef struct {
+	color_t c;
+	color_kind_t type;
+} color_wrap_t;
+
+typedef struct {
+	int x;
+	int y;
+} pos_t;
+
+#define BITMAP_WIDTH 600
+#define BITMAP_HEIGHT 600
+
+// A fill only pushes the 4 neighbours of a pixel it paints, and paints every pixel at most once
+#define FILL_STACK_SIZE ((BITMAP_WIDTH * BITMAP_HEIGHT * 4) + 1)
+
+// With -g, how many pixels a fill paints on its own before the rest goes in parallel, see Parallel fills
+#define FILL_SERIAL_MAX (BITMAP_WIDTH * BITMAP_HEIGHT / 8)
+
+/*
+ * Arenas
+ *
+ * Every render context gets one arena, a single mapping reserved up front and
+ * backed by huge pages where the kernel does that, that its bitmap stack,
+ * bucket, fill stack and tiles all come out of. Allocating is bumping an
+ * offset, nothing ever gets handed back except tiles, which go on a free list
+ * for the next copy-on-write to pick up. Pages only get touched as the arena
+ * fills, and it never grows past ARENA_SIZE: once tiles would eat into the
+ * last ARENA_RESERVE bytes they come from the heap instead, which leaves the
+ * rest for the context's own allocations.
+ */
+#define ARENA_SIZE    ((size_t)256 << 20)
+#define ARENA_RESERVE ((size_t)32 << 20)
+#define ARENA_ALIGN   64
+#define HUGE_PAGE     ((size_t)2 << 20)
+
+struct tile;
+
+typedef struct arena {
+	char *map;
+	size_t map_size;
+	char *base;        // map rounded up to a huge page
+	size_t used;       // bumped atomically, layers can get drawn on from several threads at once with -p
+
+	pthread_mutex_t free_lock;
+	struct tile *free_tiles;
+} arena_t;
+
+static arena_t *new_arena(void) {
+	arena_t *arena = (arena_t *)ecalloc(1, sizeof(arena_t));
+
+	arena->map_size = ARENA_SIZE + HUGE_PAGE;
+	arena->map = (char *)mmap(NULL, arena->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (arena->map == MAP_FAILED) {
+		panic("Failed to map a %zu byte arena\n", arena->map_size);
+	}
+	arena->base = (char *)(((uintptr_t)arena->map + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+#ifdef MADV_HUGEPAGE
+	madvise(arena->base, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+
+	pthread_mutex_init(&arena->free_lock, NULL);
+	return arena;
+}
+
+static void free_arena(arena_t *arena) {
+	if (arena == NULL) {
+		return;
+	}
+
+	munmap(arena->map, arena->map_size);
+	pthread_mutex_destroy(&arena->free_lock);
+	free(arena);
+}
+
+// Fresh zeroed memory, or NULL if it would end up in the last `reserve` bytes
+static void *arena_bump(arena_t *arena, size_t size, size_t reserve) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	size_t offset = __atomic_fetch_add(&arena->used, size, __ATOMIC_RELAXED);
+	if ((offset + size + reserve) > ARENA_SIZE) {
+		__atomic_fetch_sub(&arena->used, size, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	return arena->base + offset;
+}
+
+// Zeroed memory for a context, from its arena if it has one
+static void *arena_calloc(arena_t *arena, size_t elems, size_t size) {
+	if (arena == NULL) {
+		return ecalloc(elems, size);
+	}
+
+	void *ret = arena_bump(arena, elems * size, 0);
+	if (ret == NULL) {
+		panic("Arena is out of space (%zu of %zu bytes used)\n", arena->used, ARENA_SIZE);
+	}
+	return ret;
+}
+
+// The old block just stays behind in an arena, so only use this for things that grow geometrically
+static void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t size) {
+	if (arena == NULL) {
+		return erealloc(ptr, size);
+	}
+
+	void *ret = arena_calloc(arena, 1, size);
+	memcpy(ret, ptr, old_size);
+	return ret;
+}
+
+static void arena_free(arena_t *arena, void *ptr) {
+	if (arena == NULL) {
+		free(ptr);
+	}
+}
+
+/*
+ * Layers
+ *
+ * A layer is a grid of reference counted tiles. Copying a layer only shares
+ * its tiles, and a shared tile is copied the first time it gets written, so a
+ * checkpoint costs as much as the tiles that change after it and any number of
+ * checkpoints share whatever they have in common.
+ */
+#define TILE_SIZE   40
+#define TILES_X     (BITMAP_WIDTH / TILE_SIZE)
+#define TILES_Y     (BITMAP_HEIGHT / TILE_SIZE)
+#define TILE_COUNT  (TILES_X * TILES_Y)
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+#define tile_index(x, y)    ((((y) / TILE_SIZE) * TILES_X) + ((x) / TILE_SIZE))
+
+/*
+ * Pixels in a tile go row by row, so a fill stepping up or down lands 160
+ * bytes away. Building with -DENDO_MORTON_TILES lays them out as 8x8 bricks
+ * instead, bricks row by row and the pixels in each in Z order, so every 4x4
+ * square sits in one 64 byte line and most neighbours are in the same line or
+ * the next one. Anything that goes through tile_px_index or the tile_px_x/y
+ * inverses works either way, only layer_to_rgba has to know which.
+ */
+#ifdef ENDO_MORTON_TILES
+#define BRICK_SIZE   8
+#define BRICK_PIXELS (BRICK_SIZE * BRICK_SIZE)
+#define BRICKS_X     (TILE_SIZE / BRICK_SIZE)
+
+// Spreads the low 3 bits out to every other bit, and back
+#define morton_spread(v)  (((v) & 1) | (((v) & 2) << 1) | (((v) & 4) << 2))
+#define morton_compact(v) (((v) & 1) | (((v) >> 1) & 2) | (((v) >> 2) & 4))
+
+#define tile_px_index(x, y) ((((((y) % TILE_SIZE) / BRICK_SIZE) * BRICKS_X) + (((x) % TILE_SIZE) / BRICK_SIZE)) * BRICK_PIXELS \
+	+ (morton_spread((x) % BRICK_SIZE) | (morton_spread((y) % BRICK_SIZE) << 1)))
+#define tile_px_x(j) ((((j) / BRICK_PIXELS) % BRICKS_X) * BRICK_SIZE + morton_compact((j) % BRICK_PIXELS))
+#define tile_px_y(j) ((((j) / BRICK_PIXELS) / BRICKS_X) * BRICK_SIZE + morton_compact(((j) % BRICK_PIXELS) >> 1))
+#else
+#define tile_px_index(x, y) ((((y) % TILE_SIZE) * TILE_SIZE) + ((x) % TILE_SIZE))
+#define tile_px_x(j) ((j) % TILE_SIZE)
+#define tile_px_y(j) ((j) / TILE_SIZE)
+#endif
+
+typedef enum {
+	ALPHA_UNKNOWN,
+	ALPHA_MASK,     // every pixel is opaque or transparent black
+	ALPHA_MIXED,
+} tile_alpha_t;
+
+typedef struct tile {
+	int refs;
+	uint8_t alpha;   // tile_alpha_t, ALPHA_UNKNOWN until someone asks for it and again after every write
+	uint64_t hash;   // of the pixels, 0 until someone asks for it and again after every write
+	arena_t *arena;  // where it goes back to once nobody needs it, NULL if it came from the heap
+	color_t px[TILE_PIXELS];
+} tile_t;
+
+typedef struct {
+	arena_t *arena;  // where new tiles come from, NULL for the heap
+	tile_t *tiles[TILE_COUNT];
+} layer_t;
+
+// Every cleared tile points here. It isn't reference counted, since it's never freed and tile_mut never writes it,
+// and that keeps every thread from hammering the one counter
+static tile_t zero_tile;
+
+static tile_t *tile_ref(tile_t *tile) {
+	if (tile != &zero_tile) {
+		__atomic_add_fetch(&tile->refs, 1, __ATOMIC_RELAXED);
+	}
+	return tile;
+}
+
+// Free tiles keep the next free one where the pixels go
+#define next_free_tile(tile) (*(tile_t **)(tile)->px)
+
+static tile_t *alloc_tile(arena_t *arena) {
+	tile_t *tile = NULL;
+	if (arena) {
+		pthread_mutex_lock(&arena->free_lock);
+		tile = arena->free_tiles;
+		if (tile) {
+			arena->free_tiles = next_free_tile(tile);
+		}
+		pthread_mutex_unlock(&arena->free_lock);
+
+		if (tile == NULL) {
+			tile = (tile_t *)arena_bump(arena, sizeof(tile_t), ARENA_RESERVE);
+		}
+	}
+
+	if (tile) {
+		tile->arena = arena;
+	} else {
+		tile = (tile_t *)emalloc(sizeof(tile_t));
+		tile->arena = NULL;
+	}
+	return tile;
+}
+
+static void tile_unref(tile_t *tile) {
+	if (tile == &zero_tile) {
+		return;
+	}
+	if (__atomic_sub_fetch(&tile->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		arena_t *arena = tile->arena;
+		if (arena == NULL) {
+			free(tile);
+			return;
+		}
+
+		pthread_mutex_lock(&arena->free_lock);
+		next_free_tile(tile) = arena->free_tiles;
+		arena->free_tiles = tile;
+		pthread_mutex_unlock(&arena->free_lock);
+	}
+}
+
+static void set_tile(layer_t *layer, int tile_idx, tile_t *tile) {
+	tile_t *old_tile = layer->tiles[tile_idx];
+	layer->tiles[tile_idx] = tile_ref(tile);
+	tile_unref(old_tile);
+}
+
+// Tiles from an arena can't outlive it, so a layer given one has to be gone before the arena is
+static layer_t *new_layer(arena_t *arena) {
+	layer_t *layer = (layer_t *)emalloc(sizeof(layer_t));
+	layer->arena = arena;
+	for (int i = 0; i < TILE_COUNT; i++) {
+		layer->tiles[i] = tile_ref(&zero_tile);
+	}
+	return layer;
+}
+
+static void free_layer(layer_t *layer) {
+	for (int i = 0; i < TILE_COUNT; i++) {
+		tile_unref(layer->tiles[i]);
+	}
+	free(layer);
+}
+
+static void clear_layer(layer_t *layer) {
+	for (int i = 0; i < TILE_COUNT; i++) {
+		if (layer->tiles[i] != &zero_tile) {
+			set_tile(layer, i, &zero_tile);
+		}
+	}
+}
+
+static void copy_layer(layer_t *dst, layer_t *src) {
+	for (int i = 0; i < TILE_COUNT; i++) {
+		set_tile(dst, i, src->tiles[i]);
+	}
+}
+
+// Gets a tile that's safe to write to, copying it first if anyone else can see it
+static tile_t *tile_mut(layer_t *layer, int tile_idx) {
+	tile_t *tile = layer->tiles[tile_idx];
+	if (tile == &zero_tile || __atomic_load_n(&tile->refs, __ATOMIC_ACQUIRE) > 1) {
+		tile_t *copy = alloc_tile(layer->arena);
+		copy->refs = 1;
+		memcpy(copy->px, tile->px, sizeof(copy->px));
+
+		layer->tiles[tile_idx] = copy;
+		tile_unref(tile);
+		tile = copy;
+	}
+	__atomic_store_n(&tile->hash, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&tile->alpha, ALPHA_UNKNOWN, __ATOMIC_RELAXED);
+	return tile;
+}
+
+/*
+ * Colors are premultiplied, so a pixel with alpha 0 is transparent black. When
+ * the top of a compose or clip only has alpha 0 or 255, compose picks the top
+ * or the bottom pixel and clip keeps the bottom pixel or clears it, with no
+ * arithmetic. Traces build most of their layers from buckets that are all
+ * alpha_opaque or all alpha_transparent, so that's the common case. Anything
+ * else, even a pixel with alpha 0 that somehow isn't black, takes the normal
+ * path.
+ */
+static bool tile_is_mask(tile_t *tile) {
+	uint8_t alpha = __atomic_load_n(&tile->alpha, __ATOMIC_RELAXED);
+	if (alpha != ALPHA_UNKNOWN) {
+		return alpha == ALPHA_MASK;
+	}
+
+	uint32_t bad = 0;
+	for (int i = 0; i < TILE_PIXELS; i++) {
+		uint32_t c = tile->px[i].c;
+		bad |= (c >= 0xFF000000u || c == 0) ? 0 : 1;
+	}
+	alpha = bad ? ALPHA_MIXED : ALPHA_MASK;
+
+	__atomic_store_n(&tile->alpha, alpha, __ATOMIC_RELAXED);
+	return alpha == ALPHA_MASK;
+}
+
+// All ones where the pixel is opaque, for a pixel from a mask tile
+#define opaque_mask(c) ((uint32_t)((int32_t)(c) >> 31))
+
+// FNV-1a over the pixels, kept on the tile until it gets written
+static uint64_t tile_hash(tile_t *tile) {
+	uint64_t hash = __atomic_load_n(&tile->hash, __ATOMIC_RELAXED);
+	if (hash) {
+		return hash;
+	}
+
+	hash = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < TILE_PIXELS; i++) {
+		hash ^= tile->px[i].c;
+		hash *= 0x100000001B3ULL;
+	}
+	hash += !hash;
+
+	__atomic_store_n(&tile->hash, hash, __ATOMIC_RELAXED);
+	return hash;
+}
+
+static inline color_t layer_get(layer_t *layer, int x, int y) {
+	return layer->tiles[tile_index(x, y)]->px[tile_px_index(x, y)];
+}
+
+static inline void layer_set(layer_t *layer, int x, int y, color_t col) {
+	tile_mut(layer, tile_index(x, y))->px[tile_px_index(x, y)] = col;
+}
+
+// Flattens a layer out into plain row-major RGBA
+static void layer_to_rgba(layer_t *layer, color_t *out) {
+	for (int t = 0; t < TILE_COUNT; t++) {
+		tile_t *tile = layer->tiles[t];
+		int base_x = (t % TILES_X) * TILE_SIZE;
+		int base_y = (t / TILES_X) * TILE_SIZE;
+
+#ifdef ENDO_MORTON_TILES
+		for (int j = 0; j < TILE_PIXELS; j++) {
+			out[((base_y + tile_px_y(j)) * BITMAP_WIDTH) + base_x + tile_px_x(j)] = tile->px[j];
+		}
+#else
+		for (int y = 0; y < TILE_SIZE; y++) {
+			memcpy(out + ((base_y + y) * BITMAP_WIDTH) + base_x, tile->px + (y * TILE_SIZE), sizeof(color_t) * TILE_SIZE);
+		}
+#endif
+	}
+}
+
+/*
+ * Fill cache
+ *
+ * A fill only ever looks at the tiles its region and the region's border sit
+ * in, so a fill from the same seed with the same color over tiles with the
+ * same pixels covers exactly the same region again. Cached fills run as a
+ * scanline flood that records the region as spans along with the hashes of
+ * every tile it read. A later fill that finds an entry for its seed and color
+ * whose tiles all still hash the same just writes the spans back out.
+ */
+#define FILL_CACHE_SLOTS 256
+
+typedef struct {
+	uint16_t y;
+	uint16_t x0;
+	uint16_t x1;  // exclusive
+} fill_span_t;
+
+typedef struct {
+	bool used;
+	int x;
+	int y;
+	uint32_t color;
+
+	int tile_count;
+	uint8_t tiles[TILE_COUNT];
+	uint64_t tile_hashes[TILE_COUNT];
+
+	int span_count;
+	fill_span_t *spans;
+} fill_entry_t;
+
+typedef struct fill_cache {
+	fill_entry_t entries[FILL_CACHE_SLOTS];
+
+	// Scratch for the fill that's being recorded
+	fill_entry_t rec;
+	uint64_t touched[(TILE_COUNT + 63) / 64];
+	int span_cap;
+	int max_seeds;
+	pos_t *seeds;
+
+	int hits;
+	int misses;
+} fill_cache_t;
+
+static fill_cache_t *new_fill_cache(void) {
+	return (fill_cache_t *)ecalloc(1, sizeof(fill_cache_t));
+}
+
+static void free_fill_cache(fill_cache_t *cache) {
+	if (cache == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < FILL_CACHE_SLOTS; i++) {
+		free(cache->entries[i].spans);
+	}
+	free(cache->rec.spans);
+	free(cache->seeds);
+	free(cache);
+}
+
+static fill_entry_t *fill_cache_slot(fill_cache_t *cache, int x, int y, color_t col) {
+	uint32_t key = ((uint32_t)y * BITMAP_WIDTH + x) * 0x9E3779B1u ^ col.c * 0x85EBCA77u;
+	return &cache->entries[(key >> 16) % FILL_CACHE_SLOTS];
+}
+
+// Reads a pixel for the fill being recorded, noting the hash of its tile the first time it's looked at
+static inline color_t fill_read(fill_cache_t *cache, layer_t *layer, int x, int y) {
+	int t = tile_index(x, y);
+	if (!(cache->touched[t / 64] & (1ULL << (t % 64)))) {
+		cache->touched[t / 64] |= 1ULL << (t % 64);
+		cache->rec.tiles[cache->rec.tile_count] = t;
+		cache->rec.tile_hashes[cache->rec.tile_count] = tile_hash(layer->tiles[t]);
+		cache->rec.tile_count++;
+	}
+	return layer->tiles[t]->px[tile_px_index(x, y)];
+}
+
+static void fill_span(layer_t *layer, fill_span_t span, color_t col) {
+	int x = span.x0;
+	while (x < span.x1) {
+		int tile_end = min(((x / TILE_SIZE) + 1) * TILE_SIZE, span.x1);
+		color_t *px = tile_mut(layer, tile_index(x, span.y))->px;
+#ifdef ENDO_MORTON_TILES
+		for (; x < tile_end; x++) {
+			px[tile_px_index(x, span.y)] = col;
+		}
+#else
+		px += tile_px_index(x, span.y);
+		for (int i = 0; i < tile_end - x; i++) {
+			px[i] = col;
+		}
+		x = tile_end;
+#endif
+	}
+}
+
+static void push_fill_seed(fill_cache_t *cache, int *seed_count, int x, int y) {
+	if (*seed_count == cache->max_seeds) {
+		cache->max_seeds = max(cache->max_seeds * 2, 1024);
+		cache->seeds = (pos_t *)erealloc(cache->seeds, sizeof(pos_t) * cache->max_seeds);
+	}
+	cache->seeds[*seed_count].x = x;
+	cache->seeds[*seed_count].y = y;
+	(*seed_count)++;
+}
+
+// Pushes a seed for every run of pixels that still need filling on row y between x0 and x1
+static void push_fill_row(fill_cache_t *cache, int *seed_count, layer_t *layer, int x0, int x1, int y, color_t col) {
+	bool in_run = false;
+	for (int x = x0; x < x1; x++) {
+		bool open = fill_read(cache, layer, x, y).c != col.c;
+		if (open && !in_run) {
+			push_fill_seed(cache, seed_count, x, y);
+		}
+		in_run = open;
+	}
+}
+
+// Same region as the pixel fill in fill_bitmap, everything connected to the seed that isn't col yet
+static void record_fill(fill_cache_t *cache, layer_t *layer, int x, int y, color_t col) {
+	fill_entry_t *rec = &cache->rec;
+	rec->x = x;
+	rec->y = y;
+	rec->color = col.c;
+	rec->tile_count = 0;
+	rec->span_count = 0;
+	memset(cache->touched, 0, sizeof(cache->touched));
+
+	int seed_count = 0;
+	push_fill_seed(cache, &seed_count, x, y);
+
+	while (seed_count > 0) {
+		pos_t seed = cache->seeds[--seed_count];
+		if (fill_read(cache, layer, seed.x, seed.y).c == col.c) {
+			continue;
+		}
+
+		fill_span_t span = { seed.y, seed.x, seed.x + 1 };
+		while (span.x0 > 0 && fill_read(cache, layer, span.x0 - 1, seed.y).c != col.c) {
+			span.x0--;
+		}
+		while (span.x1 < BITMAP_WIDTH && fill_read(cache, layer, span.x1, seed.y).c != col.c) {
+			span.x1++;
+		}
+
+		fill_span(layer, span, col);
+
+		if (rec->span_count == cache->span_cap) {
+			cache->span_cap = max(cache->span_cap * 2, 256);
+			rec->spans = (fill_span_t *)erealloc(rec->spans, sizeof(fill_span_t) * cache->span_cap);
+		}
+		rec->spans[rec->span_count++] = span;
+
+		if (seed.y > 0) {
+			push_fill_row(cache, &seed_count, layer, span.x0, span.x1, seed.y - 1, col);
+		}
+		if (seed.y < (BITMAP_HEIGHT - 1)) {
+			push_fill_row(cache, &seed_count, layer, span.x0, span.x1, seed.y + 1, col);
+		}
+	}
+}
+
+static void cached_fill(fill_cache_t *cache, layer_t *layer, int x, int y, color_t col) {
+	fill_entry_t *entry = fill_cache_slot(cache, x, y, col);
+
+	bool hit = entry->used && entry->x == x && entry->y == y && entry->color == col.c;
+	for (int i = 0; hit && i < entry->tile_count; i++) {
+		hit = tile_hash(layer->tiles[entry->tiles[i]]) == entry->tile_hashes[i];
+	}
+
+	if (hit) {
+		for (int i = 0; i < entry->span_count; i++) {
+			fill_span(layer, entry->spans[i], col);
+		}
+		cache->hits++;
+		return;
+	}
+
+	record_fill(cache, layer, x, y, col);
+	cache->misses++;
+
+	// The entry takes a trimmed copy of the spans, the scratch keeps its buffer
+	fill_span_t *spans = (fill_span_t *)erealloc(entry->spans, sizeof(fill_span_t) * max(cache->rec.span_count, 1));
+	memcpy(spans, cache->rec.spans, sizeof(fill_span_t) * cache->rec.span_count);
+	*entry = cache->rec;
+	entry->used = true;
+	entry->spans = spans;
+}
+
+typedef struct pool pool_t;
+
+typedef struct {
+	int pos_x;
+	int pos_y;
+	int mark_x;
+	int mark_y;
+	dir_t dir;
+
+	int max_bitmaps;
+	int bitmap_size;
+	layer_t **bitmaps;
+
+	int max_colors;
+	int bucket_len;
+	color_wrap_t *bucket;
+
+	int max_fill_stack;
+	int fill_stack_len;
+	pos_t *fill_stack;
+	fill_cache_t *fill_cache;  // NULL unless fills get cached (-r)
+	pool_t *fill_pool;         // NULL unless big fills get split up (-g), see Parallel fills
+	int *fill_labels;
+	uint32_t *fill_marks;      // pixels the current fill got to on its own, where they're fill_gen
+	uint32_t fill_gen;
+
+	arena_t *arena;  // owns the bitmap stack, bucket, fill stack and most tiles, NULL for copies that use the heap
+
+	size_t rna_pos;
+	int inst_count;
+
+	// Running FNV-1a hash of rna[0, hash_pos), caught up lazily
+	size_t hash_pos;
+	uint64_t rna_hash;
+} fuun_state_t;
+
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME  0x100000001B3ULL
+
+// The prefix cache keys on blocks of this many bytes of RNA, see Prefix cache
+#define PREFIX_BLOCK_SIZE (7 * 8192)
+
+const color_wrap_t color_black   = {{  0,   0,   0,   0},      COLOR_RGB};
+const color_wrap_t color_white   = {{255, 255, 255,   0},      COLOR_RGB};
+const color_wrap_t color_red     = {{255,   0,   0,   0},      COLOR_RGB};
+const color_wrap_t color_green   = {{  0, 255,   0,   0},      COLOR_RGB};
+const color_wrap_t color_blue    = {{  0,   0, 255,   0},      COLOR_RGB};
+const color_wrap_t color_yellow  = {{255, 255,   0,   0},      COLOR_RGB};
+const color_wrap_t color_magenta = {{255,   0, 255,   0},      COLOR_RGB};
+const color_wrap_t color_cyan    = {{  0, 255, 255,   0},      COLOR_RGB};
+const color_wrap_t alpha_opaque       = {{  0,   0,   0, 255}, COLOR_ALPHA};
+const color_wrap_t alpha_transparent  = {{  0,   0,   0, 0},   COLOR_ALPHA};
+
+// x / 255 for any x up to 255 * 255, without dividing
+static inline uint32_t div255(uint32_t x) {
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+static color_t get_cur_col(fuun_state_t *state) {
+	uint32_t rsum = 0;
+	uint32_t gsum = 0;
+	uint32_t bsum = 0;
+	uint32_t asum = 0;
+
+	int rgb_count   = 0;
+	int alpha_count = 0;
+
+	for (int i = 0; i < state->bucket_len; i++) {
+		color_wrap_t col = state->bucket[i];
+		switch (col.type) {
+			case COLOR_RGB: {
+				rsum += col.c.r;
+				gsum += col.c.g;
+				bsum += col.c.b;
+				rgb_count++;
+			} break;
+			case COLOR_ALPHA: {
+				asum += col.c.a;
+				alpha_count++;
+			} break;
+			default: {
+				panic("Invalid color type! %d (%d, %d, %d, %d)\n", col.type, col.c.r, col.c.g, col.c.b, col.c.a);
+			}
+		}
+	}
+
+	int cur_r, cur_g, cur_b, cur_a;
+	if (!rgb_count) {
+		cur_r = 0;
+		cur_g = 0;
+		cur_b = 0;
+	} else {
+		cur_r = rsum / rgb_count;
+		cur_g = gsum / rgb_count;
+		cur_b = bsum / rgb_count;
+	}
+
+	if (!alpha_count) {
+		cur_a = 255;
+	} else {
+		cur_a = asum / alpha_count;
+	}
+
+	color_t cur_col;
+	cur_col.r = div255(cur_r * cur_a);
+	cur_col.g = div255(cur_g * cur_a);
+	cur_col.b = div255(cur_b * cur_a);
+	cur_col.a = cur_a;
+
+	return cur_col;
+}
+
+static inline color_t compose_px(color_t top, color_t below) {
+	color_t new_color;
+	new_color.r = top.r + div255(below.r * (255 - top.a));
+	new_color.g = top.g + div255(below.g * (255 - top.a));
+	new_color.b = top.b + div255(below.b * (255 - top.a));
+	new_color.a = top.a + div255(below.a * (255 - top.a));
+	return new_color;
+}
+
+static inline color_t clip_px(color_t top, color_t below) {
+	color_t new_color;
+	new_color.r = div255(below.r * top.a);
+	new_color.g = div255(below.g * top.a);
+	new_color.b = div255(below.b * top.a);
+	new_color.a = div255(below.a * top.a);
+	return new_color;
+}
+
+static void add_color(fuun_state_t *state, color_wrap_t color) {
+	if ((state->bucket_len + 1) >= state->max_colors) {
+		int old_max = state->max_colors;
+		state->max_colors *= 2;
+		dprintf(2, "**** Resizing from %d -> %d ****\n", old_max, state->max_colors);
+
+		state->bucket = (color_wrap_t *)arena_realloc(state->arena, state->bucket, sizeof(color_wrap_t) * old_max, sizeof(color_wrap_t) * state->max_colors);
+		memset(state->bucket + old_max, 0, sizeof(color_wrap_t) * (state->max_colors - old_max));
+	}
+
+	state->bucket[state->bucket_len++] = color;
+}
+
+static char color_buffer[20];
+static char *print_color(color_t col) {
+	sprintf(color_buffer, "%d, %d, %d, %d", col.r, col.g, col.b, col.a);
+	return color_buffer;
+}
+
+static void init_state(fuun_state_t *state) {
+	memset(state, 0, sizeof(fuun_state_t));
+	state->dir = DIR_E;
+	state->arena = new_arena();
+
+	state->max_bitmaps = 10;
+	state->bitmap_size = 1;
+	state->bitmaps = (layer_t **)arena_calloc(state->arena, state->max_bitmaps, sizeof(layer_t *));
+	for (int i = 0; i < state->max_bitmaps; i++) {
+		state->bitmaps[i] = new_layer(state->arena);
+	}
+
+	state->max_colors = 200;
+	state->bucket_len = 0;
+	state->bucket = (color_wrap_t *)arena_calloc(state->arena, state->max_colors, sizeof(color_wrap_t));
+
+	// The fill stack is big, it gets allocated by the first FILL that needs it
+	state->max_fill_stack = FILL_STACK_SIZE;
+	state->fill_stack_len = 0;
+	state->fill_stack = NULL;
+
+	state->rna_hash = FNV_OFFSET;
+}
+
+// Makes dst an independent copy of src. Layers share tiles, so this is cheap until one side draws over them
+static void clone_state(fuun_state_t *dst, fuun_state_t *src) {
+	*dst = *src;
+
+	dst->bitmaps = (layer_t **)emalloc(sizeof(layer_t *) * src->max_bitmaps);
+	for (int i = 0; i < src->max_bitmaps; i++) {
+		dst->bitmaps[i] = new_layer(NULL);
+		copy_layer(dst->bitmaps[i], src->bitmaps[i]);
+	}
+
+	dst->bucket = (color_wrap_t *)emalloc(sizeof(color_wrap_t) * src->max_colors);
+	memcpy(dst->bucket, src->bucket, sizeof(color_wrap_t) * src->max_colors);
+
+	dst->fill_stack_len = 0;
+	dst->fill_stack = NULL;
+	dst->fill_labels = NULL;
+	dst->fill_marks = NULL;
+	dst->fill_cache = NULL;
+	dst->arena = NULL;
+}
+
+// Puts a state back the way init_state left it, keeping its allocations around
+static void reset_state(fuun_state_t *state) {
+	state->pos_x = 0;
+	state->pos_y = 0;
+	state->mark_x = 0;
+	state->mark_y = 0;
+	state->dir = DIR_E;
+
+	state->bitmap_size = 1;
+	for (int i = 0; i < state->max_bitmaps; i++) {
+		clear_layer(state->bitmaps[i]);
+	}
+
+	memset(state->bucket, 0, sizeof(color_wrap_t) * state->bucket_len);
+	state->bucket_len = 0;
+
+	state->rna_pos = 0;
+	state->inst_count = 0;
+	state->hash_pos = 0;
+	state->rna_hash = FNV_OFFSET;
+}
+
+static void free_state(fuun_state_t *state) {
+	for (int i = 0; i < state->max_bitmaps; i++) {
+		free_layer(state->bitmaps[i]);
+	}
+	arena_free(state->arena, state->bitmaps);
+	arena_free(state->arena, state->bucket);
+	arena_free(state->arena, state->fill_stack);
+	arena_free(state->arena, state->fill_labels);
+	arena_free(state->arena, state->fill_marks);
+	free_fill_cache(state->fill_cache);
+	free_arena(state->arena);
+}
+
+/*
+ * Decoded RNA
+ *
+ * The interpreter runs on a decoded program instead of the raw 7 byte
+ * chunks. Chunks that aren't instructions are dropped, the rest get a small
+ * dense opcode. Every op remembers how many raw instructions it stands for and
+ * where it ends in the RNA, so passes can merge ops without losing track of
+ * where the interpreter is.
+ */
+typedef enum {
+	OP_ADD_COLOR,
+	OP_CLEAR_BUCKET,
+	OP_MOVE,
+	OP_TURN_CCLOCKWISE,
+	OP_TURN_CLOCKWISE,
+	OP_MARK,
+	OP_LINE,
+	OP_FILL,
+	OP_ADD_BITMAP,
+	OP_COMPOSE,
+	OP_CLIP,
+
+	// Any run of moves and turns, folded into one offset and turn relative to facing east
+	OP_CURSOR,
+	// Pops the top bitmap without merging it, for a COMPOSE or CLIP into a dead bitmap
+	OP_DISCARD,
+	// A run of COMPOSE, CLIP and DISCARD ops done in one pass, arg of them with their merge_kind_t 2 bits each in dx
+	OP_MERGE,
+	// Stands in for ops that were optimized out
+	OP_NOP,
+
+	OP_NONE,
+} opcode_t;
+
+typedef struct {
+	uint8_t code;
+	uint8_t arg;      // OP_ADD_COLOR: index into base_colors, OP_CURSOR: quarter turns clockwise
+	int32_t dx;       // OP_CURSOR only
+	int32_t dy;
+	uint32_t count;   // raw instructions this op stands for
+	size_t rna_start; // byte offset of its first instruction
+	size_t rna_end;   // byte offset just past its last instruction
+} op_t;
+
+typedef struct {
+	op_t *ops;
+	int len;
+	int cap;
+} prog_t;
+
+static const color_wrap_t *base_colors[] = {
+	&color_black, &color_red, &color_green, &color_yellow, &color_blue,
+	&color_magenta, &color_cyan, &color_white, &alpha_transparent, &alpha_opaque,
+};
+
+// One step in each direction
+static const int dir_dx[] = { 0, 1, 0, -1 };
+static const int dir_dy[] = { -1, 0, 1, 0 };
+
+// One step after some quarter turns clockwise from east, these double as the cos and sin of the turn
+static const int quarter_turn_dx[] = { 1, 0, -1, 0 };
+static const int quarter_turn_dy[] = { 0, 1, 0, -1 };
+
+#define dir_quarter_turns(dir) (((dir) + 3) & 3)
+
+static inline void rotate_offset(int *dx, int *dy, int quarter_turns) {
+	int x = *dx;
+	int y = *dy;
+	*dx = (x * quarter_turn_dx[quarter_turns]) - (y * quarter_turn_dy[quarter_turns]);
+	*dy = (x * quarter_turn_dy[quarter_turns]) + (y * quarter_turn_dx[quarter_turns]);
+}
+
+static int wrap_coord(int val, int size) {
+	val %= size;
+	return (val < 0) ? val + size : val;
+}
+
+// Wraps a coordinate that's at most one step off the edge
+static inline int wrap_step(int val, int size) {
+	val += (val < 0) ? size : 0;
+	val -= (val >= size) ? size : 0;
+	return val;
+}
+
+static opcode_t decode_inst(uint64_t rna_val, uint8_t *arg) {
+	*arg = 0;
+	switch (rna_val) {
+		case ADD_COLOR_BLACK:       *arg = 0; return OP_ADD_COLOR;
+		case ADD_COLOR_RED:         *arg = 1; return OP_ADD_COLOR;
+		case ADD_COLOR_GREEN:       *arg = 2; return OP_ADD_COLOR;
+		case ADD_COLOR_YELLOW:      *arg = 3; return OP_ADD_COLOR;
+		case ADD_COLOR_BLUE:        *arg = 4; return OP_ADD_COLOR;
+		case ADD_COLOR_MAGENTA:     *arg = 5; return OP_ADD_COLOR;
+		case ADD_COLOR_CYAN:        *arg = 6; return OP_ADD_COLOR;
+		case ADD_COLOR_WHITE:       *arg = 7; return OP_ADD_COLOR;
+		case ADD_ALPHA_TRANSPARENT: *arg = 8; return OP_ADD_COLOR;
+		case ADD_ALPHA_OPAQUE:      *arg = 9; return OP_ADD_COLOR;
+		case CLEAR_BUCKET:          return OP_CLEAR_BUCKET;
+		case MOVE:                  return OP_MOVE;
+		case TURN_CCLOCKWISE:       return OP_TURN_CCLOCKWISE;
+		case TURN_CLOCKWISE:        return OP_TURN_CLOCKWISE;
+		case MARK:                  return OP_MARK;
+		case LINE:                  return OP_LINE;
+		case FILL:                  return OP_FILL;
+		case ADD_BITMAP:            return OP_ADD_BITMAP;
+		case COMPOSE:               return OP_COMPOSE;
+		case CLIP:                  return OP_CLIP;
+		default:                    return OP_NONE;
+	}
+}
+
+static char *get_op_name(op_t *op) {
+	switch (op->code) {
+		case OP_CURSOR:  return "Cursor";
+		case OP_DISCARD: return "Discard Bitmap";
+		case OP_MERGE:   return "Merge";
+		case OP_NOP:     return "Nop";
+		default:        return NULL;
+	}
+}
+
+static void push_op(prog_t *prog, op_t op) {
+	if (prog->len == prog->cap) {
+		prog->cap = max(prog->cap * 2, 1024);
+		prog->ops = (op_t *)erealloc(prog->ops, sizeof(op_t) * prog->cap);
+	}
+	prog->ops[prog->len++] = op;
+}
+
+static void decode_rna(prog_t *prog, char *rna_buffer, size_t rna_start, size_t rna_size) {
+	for (size_t i = rna_start; (i + 7) <= rna_size; i += 7) {
+		op_t op = {0};
+		op.code = decode_inst(get_rna_seq(rna_buffer + i), &op.arg);
+		if (op.code == OP_NONE) {
+			continue;
+		}
+
+		op.count = 1;
+		op.rna_start = i;
+		op.rna_end = i + 7;
+		push_op(prog, op);
+	}
+}
+
+/*
+ * Cursor folding
+ *
+ * Moves and turns only ever touch the cursor, so a run of them collapses into
+ * a single OP_CURSOR. The offset is worked out as if we started facing east
+ * and gets rotated at run time, so it doesn't matter where the run starts.
+ * Anything that reads the cursor ends a run. So does any op the caller needs
+ * to be able to stop right after, see fold_barrier.
+ */
+static bool is_cursor_op(op_t *op) {
+	return op->code == OP_MOVE || op->code == OP_TURN_CLOCKWISE || op->code == OP_TURN_CCLOCKWISE || op->code == OP_CURSOR;
+}
+
+// Where the caller has to be able to stop, 0/-1 for the ones it doesn't need
+typedef struct {
+	int stop_at;            // the -n instruction
+	bool block_boundaries;  // prefix cache blocks
+	int checkpoint_every;   // -k
+	int frame_every;        // -f
+} fold_stops_t;
+
+static bool fold_barrier(prog_t *prog, int i, int inst_after, fold_stops_t *stops) {
+	if (inst_after == stops->stop_at) {
+		return true;
+	}
+	if (stops->checkpoint_every && (inst_after % stops->checkpoint_every) == 0) {
+		return true;
+	}
+	if (stops->frame_every && (inst_after % stops->frame_every) == 0) {
+		return true;
+	}
+	if (stops->block_boundaries) {
+		size_t next_start = ((i + 1) < prog->len) ? prog->ops[i + 1].rna_start : SIZE_MAX;
+		size_t boundary = (next_start / PREFIX_BLOCK_SIZE) * PREFIX_BLOCK_SIZE;
+		return boundary >= prog->ops[i].rna_end;
+	}
+	return false;
+}
+
+static void fold_cursor_ops(prog_t *prog, int inst_start, fold_stops_t *stops) {
+	int out = 0;
+	int inst = inst_start;
+
+	int i = 0;
+	while (i < prog->len) {
+		if (!is_cursor_op(&prog->ops[i])) {
+			inst += prog->ops[i].count;
+			prog->ops[out++] = prog->ops[i++];
+			continue;
+		}
+
+		op_t folded = {0};
+		folded.code = OP_CURSOR;
+		folded.rna_start = prog->ops[i].rna_start;
+
+		int run_len = 0;
+		int turns = 0;
+		for (; i < prog->len && is_cursor_op(&prog->ops[i]); i++) {
+			op_t *op = &prog->ops[i];
+			switch (op->code) {
+				case OP_MOVE: {
+					folded.dx += quarter_turn_dx[turns];
+					folded.dy += quarter_turn_dy[turns];
+				} break;
+				case OP_TURN_CLOCKWISE: {
+					turns = (turns + 1) & 3;
+				} break;
+				case OP_TURN_CCLOCKWISE: {
+					turns = (turns + 3) & 3;
+				} break;
+				case OP_CURSOR: {
+					int dx = op->dx;
+					int dy = op->dy;
+					rotate_offset(&dx, &dy, turns);
+					folded.dx += dx;
+					folded.dy += dy;
+					turns = (turns + op->arg) & 3;
+				} break;
+			}
+
+			folded.count += op->count;
+			folded.rna_end = op->rna_end;
+			inst += op->count;
+			run_len++;
+
+			if (fold_barrier(prog, i, inst, stops)) {
+				i++;
+				break;
+			}
+		}
+
+		if (run_len == 1) {
+			prog->ops[out++] = prog->ops[i - 1];
+		} else {
+			folded.arg = turns;
+			prog->ops[out++] = folded;
+		}
+	}
+
+	prog->len = out;
+}
+
+/*
+ * Merge fusion
+ *
+ * Collapsing the stack is a run of COMPOSE and CLIP ops, each one a full pass
+ * reading two bitmaps and writing one. A run of them (and of OP_DISCARDs)
+ * becomes one OP_MERGE that carries every pixel down through the whole run
+ * in one go, so each bitmap only gets read once and only the bottom one gets
+ * written. Stops the same way cursor folding does, see fold_barrier.
+ */
+#define MERGE_RUN_MAX 16
+
+typedef enum {
+	MERGE_COMPOSE,
+	MERGE_CLIP,
+	MERGE_DISCARD,
+	MERGE_KIND_COUNT,
+} merge_kind_t;
+
+#define merge_kind(op, i) (((op)->dx >> (2 * (i))) & 3)
+
+// The merge_kind_t for an op, or -1 if it doesn't merge bitmaps
+static int op_merge_kind(op_t *op) {
+	switch (op->code) {
+		case OP_COMPOSE: return MERGE_COMPOSE;
+		case OP_CLIP:    return MERGE_CLIP;
+		case OP_DISCARD: return MERGE_DISCARD;
+		default:         return -1;
+	}
+}
+
+static void fuse_merges(prog_t *prog, int inst_start, fold_stops_t *stops) {
+	int out = 0;
+	int inst = inst_start;
+
+	int i = 0;
+	while (i < prog->len) {
+		if (op_merge_kind(&prog->ops[i]) < 0) {
+			inst += prog->ops[i].count;
+			prog->ops[out++] = prog->ops[i++];
+			continue;
+		}
+
+		op_t fused = {0};
+		fused.code = OP_MERGE;
+		fused.rna_start = prog->ops[i].rna_start;
+
+		int run_len = 0;
+		for (; i < prog->len && run_len < MERGE_RUN_MAX && op_merge_kind(&prog->ops[i]) >= 0; i++) {
+			op_t *op = &prog->ops[i];
+			fused.dx |= op_merge_kind(op) << (2 * run_len);
+			fused.count += op->count;
+			fused.rna_end = op->rna_end;
+			inst += op->count;
+			run_len++;
+
+			if (fold_barrier(prog, i, inst, stops)) {
+				i++;
+				break;
+			}
+		}
+
+		if (run_len == 1) {
+			prog->ops[out++] = prog->ops[i - 1];
+		} else {
+			fused.arg = run_len;
+			prog->ops[out++] = fused;
+		}
+	}
+
+	prog->len = out;
+}
+
+// Drops the top bitmap, it goes to the back of the list already cleared
+static void pop_bitmap(fuun_state_t *state) {
+	// Do some pointer shuffling so I don't have do free/realloc memory
+	layer_t *tmp_bitmap_ptr = state->bitmaps[0];
+	clear_layer(tmp_bitmap_ptr);
+
+	state->bitmap_size--;
+	memmove(state->bitmaps, state->bitmaps + 1, sizeof(layer_t *) * state->bitmap_size);
+	state->bitmaps[state->bitmap_size] = tmp_bitmap_ptr;
+}
+
+static void push_bitmap(fuun_state_t *state) {
+	layer_t *tmp_bmp_ptr = state->bitmaps[state->bitmap_size];
+	memmove(state->bitmaps + 1, state->bitmaps, sizeof(layer_t *) * state->bitmap_size);
+
+	state->bitmaps[0] = tmp_bmp_ptr;
+	clear_layer(state->bitmaps[0]);
+
+	state->bitmap_size++;
+}
+
+static void compose_layers(layer_t *top, layer_t *below) {
+	for (int t = 0; t < TILE_COUNT; t++) {
+		// Transparent black over anything changes nothing, anything over transparent black is itself
+		if (top->tiles[t] == &zero_tile) {
+			continue;
+		}
+		if (below->tiles[t] == &zero_tile) {
+			set_tile(below, t, top->tiles[t]);
+			continue;
+		}
+
+		color_t *top_px = top->tiles[t]->px;
+		color_t *below_px = tile_mut(below, t)->px;
+		if (tile_is_mask(top->tiles[t])) {
+			for (int j = 0; j < TILE_PIXELS; j++) {
+				below_px[j].c = top_px[j].c | (below_px[j].c & ~opaque_mask(top_px[j].c));
+			}
+			continue;
+		}
+		for (int j = 0; j < TILE_PIXELS; j++) {
+			below_px[j] = compose_px(top_px[j], below_px[j]);
+		}
+	}
+}
+
+static void clip_layers(layer_t *top, layer_t *below) {
+	for (int t = 0; t < TILE_COUNT; t++) {
+		// Anything clipped to or by transparent black is transparent black
+		if (below->tiles[t] == &zero_tile) {
+			continue;
+		}
+		if (top->tiles[t] == &zero_tile) {
+			set_tile(below, t, &zero_tile);
+			continue;
+		}
+
+		color_t *top_px = top->tiles[t]->px;
+		color_t *below_px = tile_mut(below, t)->px;
+		if (tile_is_mask(top->tiles[t])) {
+			for (int j = 0; j < TILE_PIXELS; j++) {
+				below_px[j].c &= opaque_mask(top_px[j].c);
+			}
+			continue;
+		}
+		for (int j = 0; j < TILE_PIXELS; j++) {
+			below_px[j] = clip_px(top_px[j], below_px[j]);
+		}
+	}
+}
+
+// Same as k merges of layers[0] into layers[1] and so on down, one pass with the result in layers[k]
+static void merge_layers(layer_t **layers, uint8_t *kinds, int k) {
+	for (int t = 0; t < TILE_COUNT; t++) {
+		// As far as it goes on which tiles are clear alone, same rules as compose_layers and clip_layers
+		tile_t *acc = layers[0]->tiles[t];
+		int i = 1;
+		for (; i <= k; i++) {
+			tile_t *below = layers[i]->tiles[t];
+			if (kinds[i - 1] == MERGE_DISCARD || (kinds[i - 1] == MERGE_COMPOSE && acc == &zero_tile)) {
+				acc = below;
+			} else if (kinds[i - 1] == MERGE_COMPOSE && below == &zero_tile) {
+				continue;
+			} else if (kinds[i - 1] == MERGE_CLIP && (acc == &zero_tile || below == &zero_tile)) {
+				acc = &zero_tile;
+			} else {
+				break;
+			}
+		}
+
+		if (i > k) {
+			if (acc != layers[k]->tiles[t]) {
+				set_tile(layers[k], t, acc);
+			}
+			continue;
+		}
+
+		// The rest go a tile at a time through a buffer that stays in L1, each step is a plain loop the compiler can vectorize.
+		// Anything tile_mut copies away from is still held by another layer, so the pointers stay good
+		color_t *below_px[MERGE_RUN_MAX + 1];
+		for (int m = i; m <= k; m++) {
+			below_px[m] = layers[m]->tiles[t]->px;
+		}
+
+		color_t buf[TILE_PIXELS];
+		memcpy(buf, acc->px, sizeof(buf));
+
+		// Only the first step has a real tile on top to know the alpha of
+		bool mask = tile_is_mask(acc);
+		for (int m = i; m <= k; m++) {
+			color_t *px = below_px[m];
+			int kind = kinds[m - 1] + (mask ? MERGE_KIND_COUNT : 0);
+			mask = false;
+			switch (kind) {
+				case MERGE_KIND_COUNT + MERGE_COMPOSE: {
+					for (int j = 0; j < TILE_PIXELS; j++) {
+						buf[j].c |= px[j].c & ~opaque_mask(buf[j].c);
+					}
+				} break;
+				case MERGE_KIND_COUNT + MERGE_CLIP: {
+					for (int j = 0; j < TILE_PIXELS; j++) {
+						buf[j].c = px[j].c & opaque_mask(buf[j].c);
+					}
+				} break;
+				case MERGE_COMPOSE: {
+					for (int j = 0; j < TILE_PIXELS; j++) {
+						buf[j] = compose_px(buf[j], px[j]);
+					}
+				} break;
+				case MERGE_CLIP: {
+					for (int j = 0; j < TILE_PIXELS; j++) {
+						buf[j] = clip_px(buf[j], px[j]);
+					}
+				} break;
+				default: {
+					memcpy(buf, px, sizeof(buf));
+				} break;
+			}
+		}
+		memcpy(tile_mut(layers[k], t)->px, buf, sizeof(buf));
+	}
+}
+
+static void compose_bitmaps(fuun_state_t *state) {
+	compose_layers(state->bitmaps[0], state->bitmaps[1]);
+	pop_bitmap(state);
+}
+
+static void clip_bitmaps(fuun_state_t *state) {
+	clip_layers(state->bitmaps[0], state->bitmaps[1]);
+	pop_bitmap(state);
+}
+
+static void merge_bitmaps(fuun_state_t *state, op_t *op) {
+	// Once the stack is down to one bitmap the rest would do nothing
+	int k = min((int)op->arg, state->bitmap_size - 1);
+	if (k <= 0) {
+		return;
+	}
+
+	uint8_t kinds[MERGE_RUN_MAX];
+	for (int i = 0; i < k; i++) {
+		kinds[i] = merge_kind(op, i);
+	}
+	merge_layers(state->bitmaps, kinds, k);
+
+	for (int i = 0; i < k; i++) {
+		pop_bitmap(state);
+	}
+}
+
+static void draw_line(layer_t *layer, int x0, int y0, int x1, int y1, color_t col) {
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	int d = max(abs(dx), abs(dy));
+
+	int c = ((dx * dy) <= 0) ? 1 : 0;
+
+	int offset = (d - c) / 2;
+	int x = x0 * d + offset;
+	int y = y0 * d + offset;
+
+	for (int j = 0; j < d; j++) {
+		int px_x = x / d;
+		int px_y = y / d;
+
+		layer_set(layer, px_x, px_y, col);
+
+		x += dx;
+		y += dy;
+	}
+
+	layer_set(layer, x1, y1, col);
+}
+
+static void parallel_fill(fuun_state_t *state, int x, int y, color_t new_color);
+
+static void fill_bitmap(fuun_state_t *state, int x, int y, color_t new_color) {
+	color_t old_color = layer_get(state->bitmaps[0], x, y);
+
+	if (new_color.c == old_color.c) {
+		return;
+	}
+
+	if (state->fill_cache) {
+		cached_fill(state->fill_cache, state->bitmaps[0], x, y, new_color);
+		return;
+	}
+
+	// With -g a fill that gets big enough goes on in parallel, which needs to know what it already got to
+	bool hand_over = state->fill_pool != NULL;
+	if (hand_over && state->fill_marks == NULL) {
+		state->fill_marks = (uint32_t *)arena_calloc(state->arena, BITMAP_WIDTH * BITMAP_HEIGHT, sizeof(uint32_t));
+	}
+	if (hand_over && ++state->fill_gen == 0) {
+		memset(state->fill_marks, 0, sizeof(uint32_t) * BITMAP_WIDTH * BITMAP_HEIGHT);
+		state->fill_gen = 1;
+	}
+	int filled = 0;
+
+	if (state->fill_stack == NULL) {
+		state->fill_stack = (pos_t *)arena_calloc(state->arena, state->max_fill_stack, sizeof(pos_t));
+	}
+
+	state->fill_stack_len = 1;
+	state->fill_stack[0].x = x;
+	state->fill_stack[0].y = y;
+
+	while (state->fill_stack_len > 0) {
+		pos_t cur_pos = state->fill_stack[--state->fill_stack_len];
+
+		layer_t *cur_bitmap = state->bitmaps[0];
+		color_t px_color = layer_get(cur_bitmap, cur_pos.x, cur_pos.y);
+
+		if (px_color.c == new_color.c) {
+			continue;
+		}
+
+		trace("checking: (%d, %d)\n", cur_pos.x, cur_pos.y);
+
+		layer_set(cur_bitmap, cur_pos.x, cur_pos.y, new_color);
+
+		if (hand_over) {
+			state->fill_marks[(cur_pos.y * BITMAP_WIDTH) + cur_pos.x] = state->fill_gen;
+			if (++filled == FILL_SERIAL_MAX) {
+				state->fill_stack_len = 0;
+				parallel_fill(state, x, y, new_color);
+				return;
+			}
+		}
+
+		if (cur_pos.x > 0) {
+			state->fill_stack[state->fill_stack_len].x = cur_pos.x - 1;
+			state->fill_stack[state->fill_stack_len].y = cur_pos.y;
+
+			state->fill_stack_len++;
+		}
+		if (cur_pos.x < (BITMAP_WIDTH - 1)) {
+			state->fill_stack[state->fill_stack_len].x = cur_pos.x + 1;
+			state->fill_stack[state->fill_stack_len].y = cur_pos.y;
+			state->fill_stack_len++;
+		}
+		if (cur_pos.y > 0) {
+			state->fill_stack[state->fill_stack_len].x = cur_pos.x;
+			state->fill_stack[state->fill_stack_len].y = cur_pos.y - 1;
+			state->fill_stack_len++;
+		}
+		if (cur_pos.y < (BITMAP_HEIGHT - 1)) {
+			state->fill_stack[state->fill_stack_len].x = cur_pos.x;
+			state->fill_stack[state->fill_stack_len].y = cur_pos.y + 1;
+			state->fill_stack_len++;
+		}
+
+		if (state->fill_stack_len > state->max_fill_stack) {
+			panic("%d > %d, Yikes!\n", state->fill_stack_len, state->max_fill_stack);
+		}
+	}
+}
+
+/*
+ * Op handlers
+ *
+ * One handler per opcode. exec_op runs a single op through a switch, which is
+ * what the passes that need to look at every op use. exec_ops runs a whole
+ * stretch of the program and, where the compiler has labels as values, jumps
+ * straight from the end of each handler to the next one through a table
+ * indexed by opcode, so every handler gets its own indirect branch to predict.
+ */
+static inline void exec_add_bitmap(fuun_state_t *state, op_t *op) {
+	(void)op;
+	trace("Bitmap Count: %d\n", state->bitmap_size);
+	if (state->bitmap_size < state->max_bitmaps) {
+		push_bitmap(state);
+	}
+}
+
+static inline void exec_compose(fuun_state_t *state, op_t *op) {
+	(void)op;
+	if (state->bitmap_size >= 2) {
+		compose_bitmaps(state);
+	}
+}
+
+static inline void exec_clip(fuun_state_t *state, op_t *op) {
+	(void)op;
+	if (state->bitmap_size >= 2) {
+		clip_bitmaps(state);
+	}
+}
+
+static inline void exec_discard(fuun_state_t *state, op_t *op) {
+	(void)op;
+	if (state->bitmap_size >= 2) {
+		pop_bitmap(state);
+	}
+}
+
+static inline void exec_merge(fuun_state_t *state, op_t *op) {
+	merge_bitmaps(state, op);
+}
+
+static inline void exec_nop(fuun_state_t *state, op_t *op) {
+	(void)state;
+	(void)op;
+}
+
+static inline void exec_add_color(fuun_state_t *state, op_t *op) {
+	add_color(state, *base_colors[op->arg]);
+}
+
+static inline void exec_fill(fuun_state_t *state, op_t *op) {
+	(void)op;
+	color_t new_color = get_cur_col(state);
+	trace("Filling with color: (%d, %d, %d, %d)\n", new_color.r, new_color.g, new_color.b, new_color.a);
+
+	fill_bitmap(state, state->pos_x, state->pos_y, new_color);
+}
+
+static inline void exec_clear_bucket(fuun_state_t *state, op_t *op) {
+	(void)op;
+	memset(state->bucket, 0, sizeof(color_wrap_t) * state->bucket_len);
+	state->bucket_len = 0;
+}
+
+static inline void exec_line(fuun_state_t *state, op_t *op) {
+	(void)op;
+	color_t cur_col = get_cur_col(state);
+	trace("Drawing line with (%s) (%d, %d) -> (%d, %d)\n", print_color(cur_col), state->pos_x, state->pos_y, state->mark_x, state->mark_y);
+
+	draw_line(state->bitmaps[0], state->pos_x, state->pos_y, state->mark_x, state->mark_y, cur_col);
+
+	// Do something interesting here
+}
+
+static inline void exec_mark(fuun_state_t *state, op_t *op) {
+	(void)op;
+	state->mark_x = state->pos_x;
+	state->mark_y = state->pos_y;
+}
+
+static inline void exec_turn_cclockwise(fuun_state_t *state, op_t *op) {
+	(void)op;
+	state->dir = (dir_t)((state->dir + 3) & 3);
+}
+
+static inline void exec_turn_clockwise(fuun_state_t *state, op_t *op) {
+	(void)op;
+	state->dir = (dir_t)((state->dir + 1) & 3);
+}
+
+static inline void exec_move(fuun_state_t *state, op_t *op) {
+	(void)op;
+	state->pos_x = wrap_step(state->pos_x + dir_dx[state->dir], BITMAP_WIDTH);
+	state->pos_y = wrap_step(state->pos_y + dir_dy[state->dir], BITMAP_HEIGHT);
+}
+
+static inline void exec_cursor(fuun_state_t *state, op_t *op) {
+	// Offsets are relative to facing east, so rotate them into the direction we're actually facing
+	int dx = op->dx;
+	int dy = op->dy;
+	rotate_offset(&dx, &dy, dir_quarter_turns(state->dir));
+
+	state->pos_x = wrap_coord(state->pos_x + dx, BITMAP_WIDTH);
+	state->pos_y = wrap_coord(state->pos_y + dy, BITMAP_HEIGHT);
+	state->dir = (dir_t)((state->dir + op->arg) & 3);
+}
+
+#define OP_HANDLERS(X) \
+	X(OP_ADD_COLOR, exec_add_color) \
+	X(OP_CLEAR_BUCKET, exec_clear_bucket) \
+	X(OP_MOVE, exec_move) \
+	X(OP_TURN_CCLOCKWISE, exec_turn_cclockwise) \
+	X(OP_TURN_CLOCKWISE, exec_turn_clockwise) \
+	X(OP_MARK, exec_mark) \
+	X(OP_LINE, exec_line) \
+	X(OP_FILL, exec_fill) \
+	X(OP_ADD_BITMAP, exec_add_bitmap) \
+	X(OP_COMPOSE, exec_compose) \
+	X(OP_CLIP, exec_clip) \
+	X(OP_CURSOR, exec_cursor) \
+	X(OP_DISCARD, exec_discard) \
+	X(OP_MERGE, exec_merge) \
+	X(OP_NOP, exec_nop)
+
+static void exec_op(fuun_state_t *state, op_t *op) {
+	switch (op->code) {
+#define X(code, handler) case code: handler(state, op); break;
+		OP_HANDLERS(X)
+#undef X
+		default: {
+			panic("Unhandled op: %d\n", op->code);
+		}
+	}
+}
+
+#if defined(__GNUC__) && !defined(ENDO_NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// Runs ops up to end, keeping the instruction count and RNA position up to date as it goes
+static void exec_ops(fuun_state_t *state, op_t *op, op_t *end) {
+#ifdef THREADED_DISPATCH
+	static void *const dispatch[OP_NONE + 1] = {
+#define X(code, handler) [code] = &&do_##code,
+		OP_HANDLERS(X)
+#undef X
+		[OP_NONE] = &&do_OP_NONE,
+	};
+
+#define NEXT_OP() do { \
+		if (op == end) { \
+			return; \
+		} \
+		goto *dispatch[op->code]; \
+	} while (0)
+
+	NEXT_OP();
+
+#define X(code, handler) \
+	do_##code: \
+		handler(state, op); \
+		state->inst_count += op->count; \
+		state->rna_pos = op->rna_end; \
+		op++; \
+		NEXT_OP();
+	OP_HANDLERS(X)
+#undef X
+
+	do_OP_NONE:
+		panic("Unhandled op: %d\n", op->code);
+#undef NEXT_OP
+#else
+	for (; op < end; op++) {
+		exec_op(state, op);
+		state->inst_count += op->count;
+		state->rna_pos = op->rna_end;
+	}
+#endif
+}
+
+/*
+ * Dead drawing elimination
+ *
+ * Only the final top bitmap matters, so anything that can't reach it can go.
+ * Which bitmap each op works on is fixed by the ADD_BITMAP/COMPOSE/CLIP ops
+ * before it, so a forward pass gives every bitmap an id and tracks the ones
+ * that are still one flat color along with the bucket. A backward pass then
+ * keeps only ops feeding a live bitmap, bucket adds that some live LINE or
+ * FILL reads before the bucket gets cleared, and cursor ops that come before
+ * some live LINE or FILL. A FILL over a flat bitmap covers all of it and
+ * kills everything drawn there before. A COMPOSE or CLIP into a dead bitmap
+ * still has to pop the stack, so it turns into an OP_DISCARD.
+ *
+ * This changes every intermediate state, only the final image is the same.
+ */
+enum {
+	DCE_DRAWS,
+	DCE_NOOP,         // does nothing at all where it runs
+	DCE_FILL_COVERS,  // fills a flat bitmap, so it covers the whole thing
+};
+
+static bool layer_is_clear(layer_t *layer) {
+	for (int t = 0; t < TILE_COUNT; t++) {
+		if (layer->tiles[t] != &zero_tile) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void eliminate_dead_ops(prog_t *prog, fuun_state_t *state) {
+	int len = prog->len;
+	int *op_layer = (int *)emalloc(sizeof(int) * max(len, 1));
+	int *op_top = (int *)emalloc(sizeof(int) * max(len, 1));
+	uint8_t *op_kind = (uint8_t *)ecalloc(max(len, 1), sizeof(uint8_t));
+
+	int max_ids = state->bitmap_size;
+	for (int i = 0; i < len; i++) {
+		max_ids += (prog->ops[i].code == OP_ADD_BITMAP);
+	}
+
+	bool *flat = (bool *)emalloc(sizeof(bool) * max_ids);
+	color_t *flat_col = (color_t *)ecalloc(max_ids, sizeof(color_t));
+	bool *live = (bool *)ecalloc(max_ids, sizeof(bool));
+
+	int *stack = (int *)emalloc(sizeof(int) * state->max_bitmaps);
+	int depth = state->bitmap_size;
+	int next_id = 0;
+	for (int i = 0; i < depth; i++) {
+		stack[i] = next_id;
+		flat[next_id] = layer_is_clear(state->bitmaps[i]);
+		next_id++;
+	}
+
+	fuun_state_t bucket_state = {0};
+	bucket_state.max_colors = state->max_colors;
+	bucket_state.bucket = (color_wrap_t *)emalloc(sizeof(color_wrap_t) * state->max_colors);
+	for (int i = 0; i < state->bucket_len; i++) {
+		add_color(&bucket_state, state->bucket[i]);
+	}
+
+	for (int i = 0; i < len; i++) {
+		op_t *op = &prog->ops[i];
+		op_layer[i] = stack[0];
+
+		switch (op->code) {
+			case OP_ADD_COLOR: {
+				add_color(&bucket_state, *base_colors[op->arg]);
+			} break;
+			case OP_CLEAR_BUCKET: {
+				bucket_state.bucket_len = 0;
+			} break;
+			case OP_LINE: {
+				int id = stack[0];
+				color_t col = get_cur_col(&bucket_state);
+				if (flat[id] && flat_col[id].c == col.c) {
+					op_kind[i] = DCE_NOOP;
+				}
+				flat[id] = false;
+			} break;
+			case OP_FILL: {
+				int id = stack[0];
+				color_t col = get_cur_col(&bucket_state);
+				if (flat[id]) {
+					op_kind[i] = (flat_col[id].c == col.c) ? DCE_NOOP : DCE_FILL_COVERS;
+					flat_col[id] = col;
+				}
+			} break;
+			case OP_ADD_BITMAP: {
+				if (depth == state->max_bitmaps) {
+					op_kind[i] = DCE_NOOP;
+					break;
+				}
+
+				memmove(stack + 1, stack, sizeof(int) * depth);
+				depth++;
+
+				stack[0] = next_id;
+				flat[next_id] = true;
+				flat_col[next_id].c = 0;
+				next_id++;
+			} break;
+			case OP_COMPOSE:
+			case OP_CLIP:
+			case OP_DISCARD: {
+				if (depth < 2) {
+					op_kind[i] = DCE_NOOP;
+					break;
+				}
+
+				int top = stack[0];
+				int below = stack[1];
+				op_top[i] = top;
+				op_layer[i] = below;
+
+				if (op->code != OP_DISCARD) {
+					flat[below] = flat[below] && flat[top];
+					if (op->code == OP_COMPOSE) {
+						flat_col[below] = compose_px(flat_col[top], flat_col[below]);
+					} else {
+						flat_col[below] = clip_px(flat_col[top], flat_col[below]);
+					}
+				}
+
+				depth--;
+				memmove(stack, stack + 1, sizeof(int) * depth);
+			} break;
+		}
+	}
+
+	live[stack[0]] = true;
+	bool bucket_live = false;
+	bool cursor_live = false;
+
+	for (int i = len - 1; i >= 0; i--) {
+		op_t *op = &prog->ops[i];
+		bool keep = true;
+
+		switch (op->code) {
+			case OP_ADD_COLOR: {
+				keep = bucket_live;
+			} break;
+			case OP_CLEAR_BUCKET: {
+				keep = bucket_live;
+				bucket_live = false;
+			} break;
+			case OP_MOVE:
+			case OP_TURN_CCLOCKWISE:
+			case OP_TURN_CLOCKWISE:
+			case OP_MARK:
+			case OP_CURSOR: {
+				keep = cursor_live;
+			} break;
+			case OP_LINE:
+			case OP_FILL: {
+				keep = op_kind[i] != DCE_NOOP && live[op_layer[i]];
+				if (keep) {
+					bucket_live = true;
+					cursor_live = true;
+				}
+				if (keep && op_kind[i] == DCE_FILL_COVERS) {
+					live[op_layer[i]] = false;
+				}
+			} break;
+			case OP_ADD_BITMAP: {
+				keep = op_kind[i] != DCE_NOOP;
+			} break;
+			case OP_COMPOSE:
+			case OP_CLIP:
+			case OP_DISCARD: {
+				keep = op_kind[i] != DCE_NOOP;
+				if (keep && live[op_layer[i]] && op->code != OP_DISCARD) {
+					live[op_top[i]] = true;
+				} else if (keep) {
+					op->code = OP_DISCARD;
+				}
+			} break;
+			case OP_NOP: {
+				keep = false;
+			} break;
+		}
+
+		if (!keep) {
+			op->code = OP_NOP;
+		}
+	}
+
+	// Squeeze the nops out, handing their instruction counts on to the next op that's left
+	int out = 0;
+	uint32_t dropped = 0;
+	size_t dropped_start = 0;
+	for (int i = 0; i < len; i++) {
+		op_t op = prog->ops[i];
+		if (op.code == OP_NOP) {
+			if (!dropped) {
+				dropped_start = op.rna_start;
+			}
+			dropped += op.count;
+			continue;
+		}
+
+		if (dropped) {
+			op.count += dropped;
+			op.rna_start = dropped_start;
+			dropped = 0;
+		}
+		prog->ops[out++] = op;
+	}
+	if (dropped) {
+		op_t nop = {0};
+		nop.code = OP_NOP;
+		nop.count = dropped;
+		nop.rna_start = dropped_start;
+		nop.rna_end = prog->ops[len - 1].rna_end;
+		prog->ops[out++] = nop;
+	}
+	prog->len = out;
+
+	free(bucket_state.bucket);
+	free(stack);
+	free(live);
+	free(flat_col);
+	free(flat);
+	free(op_kind);
+	free(op_top);
+	free(op_layer);
+}
+
+/*
+ * Blocking queue for handing work to background threads. Pushing blocks
+ * when it's full, popping blocks until there's something to pop or the queue
+ * is closed and drained, in which case it gives back NULL.
+ */
+#define QUEUE_SIZE 64
+
+typedef struct {
+	void *items[QUEUE_SIZE];
+	int head;
+	int count;
+	bool closed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} queue_t;
+
+static void queue_init(queue_t *queue) {
+	memset(queue, 0, sizeof(queue_t));
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+
+static void queue_push(queue_t *queue, void *item) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == QUEUE_SIZE) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	queue->items[(queue->head + queue->count) % QUEUE_SIZE] = item;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void *queue_pop(queue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0 && !queue->closed) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	void *item = NULL;
+	if (queue->count) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % QUEUE_SIZE;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+static void queue_close(queue_t *queue) {
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = true;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Lock-free ring for the stages of a run, which each have exactly one thread
+ * on either end. Only the producer writes tail and only the consumer writes
+ * head, and they sit on their own cache lines. Same contract as queue_t
+ * otherwise. A side that has to wait spins for a little while and then backs
+ * off into short sleeps, so a stage that waits on a slow neighbour for the
+ * whole run doesn't eat a core doing it.
+ */
+#define RING_SIZE 64 // a power of two
+
+typedef struct {
+	void *items[RING_SIZE];
+	_Alignas(64) size_t head;
+	_Alignas(64) size_t tail;
+	bool closed;
+} ring_t;
+
+static void ring_init(ring_t *ring) {
+	memset(ring, 0, sizeof(ring_t));
+}
+
+static void ring_backoff(int *spins) {
+	if (*spins < 256) {
+		(*spins)++;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+		return;
+	}
+
+	struct timespec ts = { 0, min(20000L << (*spins - 256), 1000000L) };
+	if (*spins < 256 + 6) {
+		(*spins)++;
+	}
+	nanosleep(&ts, NULL);
+}
+
+static void ring_push(ring_t *ring, void *item) {
+	size_t tail = ring->tail;
+	int spins = 0;
+	while ((tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == RING_SIZE) {
+		ring_backoff(&spins);
+	}
+
+	ring->items[tail & (RING_SIZE - 1)] = item;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *ring_pop(ring_t *ring) {
+	size_t head = ring->head;
+	int spins = 0;
+	while (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+		// tail is written before closed, so once closed is set one more look at tail is final
+		if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+			if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+				return NULL;
+			}
+			break;
+		}
+		ring_backoff(&spins);
+	}
+
+	void *item = ring->items[head & (RING_SIZE - 1)];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+static void ring_close(ring_t *ring) {
+	__atomic_store_n(&ring->closed, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Work-stealing thread pool
+ *
+ * Every worker owns a deque of tasks. Workers push and pop at the back of
+ * their own deque and steal from the front of everyone else's when they run
+ * dry. Tasks belong to a group, and pool_wait runs tasks itself while it
+ * waits on a group, so a task is allowed to fan out and wait on more tasks.
+ * Threads that aren't workers all share the last slot id, worker_count.
+ */
+typedef struct {
+	int pending;
+} task_group_t;
+
+typedef struct {
+	void (*fn)(void *arg, int slot);
+	void *arg;
+	task_group_t *group;
+} task_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	task_t *tasks;
+	int head;
+	int count;
+	int cap;
+} task_deque_t;
+
+struct pool {
+	int worker_count;
+	pthread_t *threads;
+	task_deque_t *deques;
+
+	// Guards queued/shutdown, everyone with nothing to do sleeps on wake
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int queued;
+	bool shutdown;
+
+	int next_deque;
+};
+
+typedef struct {
+	pool_t *pool;
+	int slot;
+} pool_worker_t;
+
+static __thread int pool_slot = -1;
+
+static int pool_cur_slot(pool_t *pool) {
+	return (pool_slot >= 0) ? pool_slot : pool->worker_count;
+}
+
+static void deque_push_back(task_deque_t *dq, task_t task) {
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->cap) {
+		int new_cap = max(dq->cap * 2, 64);
+		task_t *tasks = (task_t *)emalloc(sizeof(task_t) * new_cap);
+		for (int i = 0; i < dq->count; i++) {
+			tasks[i] = dq->tasks[(dq->head + i) % dq->cap];
+		}
+		free(dq->tasks);
+
+		dq->tasks = tasks;
+		dq->head = 0;
+		dq->cap = new_cap;
+	}
+
+	dq->tasks[(dq->head + dq->count) % dq->cap] = task;
+	dq->count++;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static bool deque_pop_back(task_deque_t *dq, task_t *task) {
+	bool got = false;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dq->count--;
+		*task = dq->tasks[(dq->head + dq->count) % dq->cap];
+		got = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return got;
+}
+
+static bool deque_steal_front(task_deque_t *dq, task_t *task) {
+	bool got = false;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		*task = dq->tasks[dq->head];
+		dq->head = (dq->head + 1) % dq->cap;
+		dq->count--;
+		got = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return got;
+}
+
+static void pool_submit(pool_t *pool, task_group_t *group, void (*fn)(void *arg, int slot), void *arg) {
+	task_t task = { fn, arg, group };
+	__atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+
+	int slot = pool_slot;
+	if (slot < 0) {
+		slot = __atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED) % pool->worker_count;
+	}
+	deque_push_back(&pool->deques[slot], task);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Runs one task from our own deque or stolen from someone else's, returns false if there were none
+static bool pool_run_one(pool_t *pool) {
+	int slot = pool_cur_slot(pool);
+
+	task_t task;
+	bool got = (slot < pool->worker_count) && deque_pop_back(&pool->deques[slot], &task);
+	for (int i = 1; i <= pool->worker_count && !got; i++) {
+		got = deque_steal_front(&pool->deques[(slot + i) % pool->worker_count], &task);
+	}
+	if (!got) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pthread_mutex_unlock(&pool->lock);
+
+	task.fn(task.arg, slot);
+
+	if (__atomic_sub_fetch(&task.group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return true;
+}
+
+static void pool_wait(pool_t *pool, task_group_t *group) {
+	while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+		if (pool_run_one(pool)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *pool_worker_main(void *arg) {
+	pool_worker_t *worker = (pool_worker_t *)arg;
+	pool_t *pool = worker->pool;
+	pool_slot = worker->slot;
+	free(worker);
+
+	for (;;) {
+		if (pool_run_one(pool)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		bool shutdown = pool->shutdown && pool->queued == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (shutdown) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int cpu_count(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (int)count : 1;
+}
+
+static pool_t *pool_create(int worker_count) {
+	pool_t *pool = (pool_t *)ecalloc(1, sizeof(pool_t));
+	pool->worker_count = max(worker_count, 1);
+	pool->threads = (pthread_t *)emalloc(sizeof(pthread_t) * pool->worker_count);
+	pool->deques = (task_deque_t *)ecalloc(pool->worker_count, sizeof(task_deque_t));
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	for (int i = 0; i < pool->worker_count; i++) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+
+	for (int i = 0; i < pool->worker_count; i++) {
+		pool_worker_t *worker = (pool_worker_t *)emalloc(sizeof(pool_worker_t));
+		worker->pool = pool;
+		worker->slot = i;
+		if (pthread_create(&pool->threads[i], NULL, pool_worker_main, worker) != 0) {
+			panic("Failed to start pool worker %d\n", i);
+		}
+	}
+
+	return pool;
+}
+
+static void pool_destroy(pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->worker_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	for (int i = 0; i < pool->worker_count; i++) {
+		free(pool->deques[i].tasks);
+	}
+
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Parallel fills
+ *
+ * A fill recolors the region of pixels that aren't the new color yet, as far
+ * as it reaches from the seed. Walking it from the seed is serial, so with -g
+ * a fill that's still going after FILL_SERIAL_MAX pixels finishes as
+ * connected component labeling instead. Every tile row is a band that labels
+ * its own pixels on a worker, union-find joins the labels across the band
+ * edges, and then every band recolors its pixels that are in the seed's
+ * component. A band never touches a tile outside its row, so the workers
+ * never share a tile. Pixels the walk already recolored are marked, and count
+ * as not the new color yet, so the components are the ones the fill started
+ * with.
+ *
+ * Labels are pixel indices, and a set is always linked under its smallest
+ * one, so a label's parent is never after it. That lets a band flatten all
+ * its labels to their band root in one pass in order, and leaves only the
+ * band roots for the join to link up.
+ */
+#define FILL_LABEL_NONE  -1
+
+typedef struct {
+	layer_t *layer;
+	color_t new_color;
+	int *labels;
+	uint32_t *marks;
+	uint32_t gen;
+	int root;
+} fill_job_t;
+
+typedef struct {
+	fill_job_t *job;
+	int tile_y;
+} fill_band_t;
+
+static int find_label(int *labels, int label) {
+	while (labels[label] != label) {
+		labels[label] = labels[labels[label]];
+		label = labels[label];
+	}
+	return label;
+}
+
+static void union_labels(int *labels, int a, int b) {
+	a = find_label(labels, a);
+	b = find_label(labels, b);
+	if (a < b) {
+		labels[b] = a;
+	} else if (b < a) {
+		labels[a] = b;
+	}
+}
+
+static void label_band(void *arg, int slot) {
+	(void)slot;
+	fill_band_t *band = (fill_band_t *)arg;
+	fill_job_t *job = band->job;
+	int *labels = job->labels;
+
+	int y0 = band->tile_y * TILE_SIZE;
+	int y1 = y0 + TILE_SIZE;
+	for (int y = y0; y < y1; y++) {
+		for (int x = 0; x < BITMAP_WIDTH; x++) {
+			int p = (y * BITMAP_WIDTH) + x;
+			if (layer_get(job->layer, x, y).c == job->new_color.c && job->marks[p] != job->gen) {
+				labels[p] = FILL_LABEL_NONE;
+				continue;
+			}
+
+			labels[p] = p;
+			if (x > 0 && labels[p - 1] != FILL_LABEL_NONE) {
+				union_labels(labels, p - 1, p);
+			}
+			if (y > y0 && labels[p - BITMAP_WIDTH] != FILL_LABEL_NONE) {
+				union_labels(labels, p - BITMAP_WIDTH, p);
+			}
+		}
+	}
+
+	for (int p = y0 * BITMAP_WIDTH; p < (y1 * BITMAP_WIDTH); p++) {
+		if (labels[p] != FILL_LABEL_NONE) {
+			labels[p] = labels[labels[p]];
+		}
+	}
+}
+
+static void recolor_band(void *arg, int slot) {
+	(void)slot;
+	fill_band_t *band = (fill_band_t *)arg;
+	fill_job_t *job = band->job;
+	int *labels = job->labels;
+
+	for (int tile_x = 0; tile_x < TILES_X; tile_x++) {
+		int t = (band->tile_y * TILES_X) + tile_x;
+		tile_t *tile = NULL;
+
+		// Every band is done joining by now, so this only reads the labels
+		int last_label = FILL_LABEL_NONE;
+		bool last_in = false;
+		for (int j = 0; j < TILE_PIXELS; j++) {
+			int x = (tile_x * TILE_SIZE) + tile_px_x(j);
+			int y = (band->tile_y * TILE_SIZE) + tile_px_y(j);
+			int label = labels[(y * BITMAP_WIDTH) + x];
+			if (label == FILL_LABEL_NONE) {
+				continue;
+			}
+
+			if (label != last_label) {
+				last_label = label;
+				while (labels[label] != label) {
+					label = labels[label];
+				}
+				last_in = (label == job->root);
+			}
+			if (last_in) {
+				if (tile == NULL) {
+					tile = tile_mut(job->layer, t);
+				}
+				tile->px[j] = job->new_color;
+			}
+		}
+	}
+}
+
+// Finishes a fill from fill_bitmap with the labeling above
+static void parallel_fill(fuun_state_t *state, int x, int y, color_t new_color) {
+	if (state->fill_labels == NULL) {
+		state->fill_labels = (int *)arena_calloc(state->arena, BITMAP_WIDTH * BITMAP_HEIGHT, sizeof(int));
+	}
+
+	fill_job_t job = {0};
+	job.layer = state->bitmaps[0];
+	job.new_color = new_color;
+	job.labels = state->fill_labels;
+	job.marks = state->fill_marks;
+	job.gen = state->fill_gen;
+
+	fill_band_t bands[TILES_Y];
+	for (int i = 0; i < TILES_Y; i++) {
+		bands[i].job = &job;
+		bands[i].tile_y = i;
+	}
+
+	task_group_t group = {0};
+	for (int i = 0; i < TILES_Y; i++) {
+		pool_submit(state->fill_pool, &group, label_band, &bands[i]);
+	}
+	pool_wait(state->fill_pool, &group);
+
+	for (int i = 1; i < TILES_Y; i++) {
+		int edge = i * TILE_SIZE * BITMAP_WIDTH;
+		for (int p = edge; p < (edge + BITMAP_WIDTH); p++) {
+			if (job.labels[p] != FILL_LABEL_NONE && job.labels[p - BITMAP_WIDTH] != FILL_LABEL_NONE) {
+				union_labels(job.labels, p - BITMAP_WIDTH, p);
+			}
+		}
+	}
+	job.root = find_label(job.labels, (y * BITMAP_WIDTH) + x);
+
+	for (int i = 0; i < TILES_Y; i++) {
+		pool_submit(state->fill_pool, &group, recolor_band, &bands[i]);
+	}
+	pool_wait(state->fill_pool, &group);
+
+	// The pixels from here on aren't checked one at a time, so they only get a line for the lot
+	trace("filled the rest from (%d, %d) on %d workers\n", x, y, state->fill_pool->worker_count);
+}
+
+/*
+ * Snapshots
+ *
+ * A snapshot is the full interpreter state after some number of instructions,
+ * tagged with a hash of the RNA prefix that produced it so we never resume a
+ * different trace by accident. Only live layers are stored, run-length encoded,
+ * since most of a layer is usually one big flat region.
+ */
+#define SNAPSHOT_MAGIC   0x50414E534E555546ULL // "FUUNSNAP"
+#define SNAPSHOT_VERSION 2 // v2: directions are numbered clockwise from north
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+} byte_buf_t;
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t pos;
+} byte_reader_t;
+
+static void buf_write(byte_buf_t *buf, void *data, size_t size) {
+	if ((buf->size + size) > buf->cap) {
+		buf->cap = max(buf->cap * 2, buf->size + size);
+		buf->data = (uint8_t *)erealloc(buf->data, buf->cap);
+	}
+
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static void buf_u32(byte_buf_t *buf, uint32_t val) {
+	buf_write(buf, &val, sizeof(val));
+}
+
+static void buf_u64(byte_buf_t *buf, uint64_t val) {
+	buf_write(buf, &val, sizeof(val));
+}
+
+static bool read_bytes(byte_reader_t *rd, void *out, size_t size) {
+	if ((rd->pos + size) > rd->size) {
+		return false;
+	}
+
+	memcpy(out, rd->data + rd->pos, size);
+	rd->pos += size;
+	return true;
+}
+
+static uint32_t read_u32(byte_reader_t *rd) {
+	uint32_t val;
+	if (!read_bytes(rd, &val, sizeof(val))) {
+		panic("Snapshot is truncated!\n");
+	}
+	return val;
+}
+
+static uint64_t read_u64(byte_reader_t *rd) {
+	uint64_t val;
+	if (!read_bytes(rd, &val, sizeof(val))) {
+		panic("Snapshot is truncated!\n");
+	}
+	return val;
+}
+
+static uint64_t hash_bytes(uint64_t hash, char *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Catches the running prefix hash up to the current position
+static uint64_t prefix_hash(fuun_state_t *state, char *rna_buffer) {
+	state->rna_hash = hash_bytes(state->rna_hash, rna_buffer + state->hash_pos, state->rna_pos - state->hash_pos);
+	state->hash_pos = state->rna_pos;
+	return state->rna_hash;
+}
+
+// The prefix hash has to be caught up (see prefix_hash) before serializing
+static void serialize_state(fuun_state_t *state, byte_buf_t *buf) {
+	if (state->hash_pos != state->rna_pos) {
+		panic("Serializing a state with a stale prefix hash! (%zu != %zu)\n", state->hash_pos, state->rna_pos);
+	}
+
+	buf_u64(buf, SNAPSHOT_MAGIC);
+	buf_u32(buf, SNAPSHOT_VERSION);
+	buf_u64(buf, state->rna_pos);
+	buf_u64(buf, state->rna_hash);
+	buf_u32(buf, state->inst_count);
+
+	buf_u32(buf, state->pos_x);
+	buf_u32(buf, state->pos_y);
+	buf_u32(buf, state->mark_x);
+	buf_u32(buf, state->mark_y);
+	buf_u32(buf, state->dir);
+
+	buf_u32(buf, state->bucket_len);
+	for (int i = 0; i < state->bucket_len; i++) {
+		buf_u32(buf, state->bucket[i].c.c);
+		buf_u32(buf, state->bucket[i].type);
+	}
+
+	buf_u32(buf, state->bitmap_size);
+	for (int i = 0; i < state->bitmap_size; i++) {
+		layer_t *bitmap = state->bitmaps[i];
+
+		size_t count_pos = buf->size;
+		uint32_t run_count = 0;
+		buf_u32(buf, 0);
+
+		int j = 0;
+		while (j < (BITMAP_WIDTH * BITMAP_HEIGHT)) {
+			int run_start = j;
+			color_t run_col = layer_get(bitmap, j % BITMAP_WIDTH, j / BITMAP_WIDTH);
+			while (j < (BITMAP_WIDTH * BITMAP_HEIGHT) && layer_get(bitmap, j % BITMAP_WIDTH, j / BITMAP_WIDTH).c == run_col.c) {
+				j++;
+			}
+
+			buf_u32(buf, j - run_start);
+			buf_u32(buf, run_col.c);
+			run_count++;
+		}
+
+		memcpy(buf->data + count_pos, &run_count, sizeof(run_count));
+	}
+}
+
+typedef struct {
+	uint64_t rna_pos;
+	uint64_t rna_hash;
+	uint32_t inst_count;
+} snapshot_header_t;
+
+static bool read_snapshot_header(byte_reader_t *rd, snapshot_header_t *hdr) {
+	uint64_t magic;
+	uint32_t version;
+	if (!read_bytes(rd, &magic, sizeof(magic)) || magic != SNAPSHOT_MAGIC) {
+		return false;
+	}
+	if (!read_bytes(rd, &version, sizeof(version)) || version != SNAPSHOT_VERSION) {
+		return false;
+	}
+
+	hdr->rna_pos = read_u64(rd);
+	hdr->rna_hash = read_u64(rd);
+	hdr->inst_count = read_u32(rd);
+	return true;
+}
+
+// Expects the reader to be just past a header that's already been validated
+static void deserialize_state(fuun_state_t *state, snapshot_header_t *hdr, byte_reader_t *rd) {
+	state->rna_pos = hdr->rna_pos;
+	state->hash_pos = hdr->rna_pos;
+	state->rna_hash = hdr->rna_hash;
+	state->inst_count = hdr->inst_count;
+
+	uint32_t pos_x = read_u32(rd);
+	uint32_t pos_y = read_u32(rd);
+	uint32_t mark_x = read_u32(rd);
+	uint32_t mark_y = read_u32(rd);
+	uint32_t dir = read_u32(rd);
+	if (pos_x >= BITMAP_WIDTH || pos_y >= BITMAP_HEIGHT || mark_x >= BITMAP_WIDTH || mark_y >= BITMAP_HEIGHT) {
+		panic("Snapshot has a bad position: (%u, %u) marked (%u, %u)\n", pos_x, pos_y, mark_x, mark_y);
+	}
+	if (dir >= 4) {
+		panic("Snapshot has a bad direction: %u\n", dir);
+	}
+	state->pos_x = pos_x;
+	state->pos_y = pos_y;
+	state->mark_x = mark_x;
+	state->mark_y = mark_y;
+	state->dir = dir;
+
+	int bucket_len = read_u32(rd);
+	memset(state->bucket, 0, sizeof(color_wrap_t) * state->bucket_len);
+	state->bucket_len = 0;
+	for (int i = 0; i < bucket_len; i++) {
+		color_wrap_t col;
+		col.c.c = read_u32(rd);
+		col.type = read_u32(rd);
+		add_color(state, col);
+	}
+
+	state->bitmap_size = read_u32(rd);
+	if (state->bitmap_size < 1 || state->bitmap_size > state->max_bitmaps) {
+		panic("Snapshot has a bad bitmap count: %d\n", state->bitmap_size);
+	}
+
+	for (int i = 0; i < state->bitmap_size; i++) {
+		layer_t *bitmap = state->bitmaps[i];
+		clear_layer(bitmap);
+
+		uint32_t run_count = read_u32(rd);
+
+		int j = 0;
+		for (uint32_t k = 0; k < run_count; k++) {
+			uint32_t run_len = read_u32(rd);
+			color_t col;
+			col.c = read_u32(rd);
+
+			if ((j + run_len) > (BITMAP_WIDTH * BITMAP_HEIGHT)) {
+				panic("Snapshot bitmap %d overflows!\n", i);
+			}
+
+			if (col.c == 0) {
+				j += run_len;
+				continue;
+			}
+
+			for (uint32_t l = 0; l < run_len; l++, j++) {
+				layer_set(bitmap, j % BITMAP_WIDTH, j / BITMAP_WIDTH, col);
+			}
+		}
+
+		if (j != (BITMAP_WIDTH * BITMAP_HEIGHT)) {
+			panic("Snapshot bitmap %d is short! (%d pixels)\n", i, j);
+		}
+	}
+}
+
+static void write_file(char *filename, void *data, size_t size) {
+	char tmp_filename[PATH_MAX];
+	snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+	int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		panic("Failed to open file: %s\n", tmp_filename);
+	}
+
+	size_t written = 0;
+	while (written < size) {
+		ssize_t ret = write(fd, (uint8_t *)data + written, size - written);
+		if (ret <= 0) {
+			panic("Failed to write file: %s\n", tmp_filename);
+		}
+		written += ret;
+	}
+	close(fd);
+
+	// Rename into place so a crash mid-write never leaves a torn file behind
+	if (rename(tmp_filename, filename) == -1) {
+		panic("Failed to rename %s -> %s\n", tmp_filename, filename);
+	}
+}
+
+static void make_dir(char *dirname) {
+	if (mkdir(dirname, 0755) == -1 && errno != EEXIST) {
+		panic("Failed to create directory: %s\n", dirname);
+	}
+}
+
+static void write_state_file(fuun_state_t *state, char *filename) {
+	byte_buf_t buf = {0};
+	serialize_state(state, &buf);
+	write_file(filename, buf.data, buf.size);
+
+	trace("Wrote snapshot %s (%zu bytes)\n", filename, buf.size);
+	free(buf.data);
+}
+
+/*
+ * Snapshots get encoded and written on their own thread. The interpreter only
+ * hands over a clone of its state, which with shared tiles costs about as much
+ * as the bucket, and carries on drawing while the clone gets written out.
+ */
+typedef struct {
+	fuun_state_t state;
+	char filename[PATH_MAX];
+} snapshot_job_t;
+
+typedef struct {
+	queue_t queue;
+	pthread_t thread;
+} snapshot_writer_t;
+
+static void *snapshot_writer_main(void *arg) {
+	snapshot_writer_t *sw = (snapshot_writer_t *)arg;
+
+	snapshot_job_t *job;
+	while ((job = (snapshot_job_t *)queue_pop(&sw->queue)) != NULL) {
+		write_state_file(&job->state, job->filename);
+		free_state(&job->state);
+		free(job);
+	}
+
+	return NULL;
+}
+
+static void start_snapshot_writer(snapshot_writer_t *sw) {
+	queue_init(&sw->queue);
+	if (pthread_create(&sw->thread, NULL, snapshot_writer_main, sw) != 0) {
+		panic("Failed to start the snapshot writer thread!\n");
+	}
+}
+
+static void finish_snapshot_writer(snapshot_writer_t *sw) {
+	queue_close(&sw->queue);
+	pthread_join(sw->thread, NULL);
+}
+
+static void queue_snapshot(snapshot_writer_t *sw, fuun_state_t *state, char *rna_buffer, char *filename) {
+	prefix_hash(state, rna_buffer);
+
+	snapshot_job_t *job = (snapshot_job_t *)emalloc(sizeof(snapshot_job_t));
+	clone_state(&job->state, state);
+	snprintf(job->filename, sizeof(job->filename), "%s", filename);
+
+	queue_push(&sw->queue, job);
+}
+
+static void write_snapshot(snapshot_writer_t *sw, fuun_state_t *state, char *rna_buffer, char *snapshot_dir) {
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "%s/%010d.snap", snapshot_dir, state->inst_count);
+	queue_snapshot(sw, state, rna_buffer, filename);
+}
+
+// Loads filename into state if it's a valid snapshot of this trace's prefix and not past stop_at
+static bool load_state_file(fuun_state_t *state, char *filename, char *rna_buffer, size_t rna_size, int stop_at) {
+	size_t snap_size;
+	byte_reader_t rd = {0};
+	rd.data = (uint8_t *)read_file(filename, &snap_size);
+	rd.size = snap_size;
+
+	bool loaded = false;
+	snapshot_header_t hdr;
+	if (!read_snapshot_header(&rd, &hdr)) {
+		dprintf(2, "Skipping %s, not a v%d snapshot\n", filename, SNAPSHOT_VERSION);
+	} else if (hdr.rna_pos > rna_size || hash_bytes(FNV_OFFSET, rna_buffer, hdr.rna_pos) != hdr.rna_hash) {
+		dprintf(2, "Skipping %s, it was made from a different trace\n", filename);
+	} else if (stop_at >= 0 && hdr.inst_count > stop_at) {
+		trace("Skipping %s, it's past instruction %d\n", filename, stop_at);
+	} else {
+		deserialize_state(state, &hdr, &rd);
+		printf("Resuming from %s at instruction %d\n", filename, state->inst_count);
+		loaded = true;
+	}
+
+	free(rd.data);
+	return loaded;
+}
+
+static int cmp_int_desc(const void *a, const void *b) {
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	return (x < y) - (x > y);
+}
+
+/*
+ * Loads the latest snapshot in snapshot_dir at or before stop_at (any, if
+ * stop_at < 0) that was produced by this same RNA prefix. Returns false if
+ * there was nothing usable and the state is untouched.
+ */
+static bool resume_from_snapshot(fuun_state_t *state, char *rna_buffer, size_t rna_size, char *snapshot_dir, int stop_at) {
+	DIR *dir = opendir(snapshot_dir);
+	if (dir == NULL) {
+		return false;
+	}
+
+	int max_snaps = 64;
+	int snap_count = 0;
+	int *snaps = (int *)emalloc(sizeof(int) * max_snaps);
+
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		char *end;
+		long inst = strtol(ent->d_name, &end, 10);
+		if (end == ent->d_name || strcmp(end, ".snap") != 0) {
+			continue;
+		}
+		if (stop_at >= 0 && inst > stop_at) {
+			continue;
+		}
+
+		if (snap_count == max_snaps) {
+			max_snaps *= 2;
+			snaps = (int *)erealloc(snaps, sizeof(int) * max_snaps);
+		}
+		snaps[snap_count++] = (int)inst;
+	}
+	closedir(dir);
+
+	qsort(snaps, snap_count, sizeof(int), cmp_int_desc);
+
+	bool resumed = false;
+	for (int i = 0; i < snap_count && !resumed; i++) {
+		char filename[PATH_MAX];
+		snprintf(filename, sizeof(filename), "%s/%010d.snap", snapshot_dir, snaps[i]);
+		resumed = load_state_file(state, filename, rna_buffer, rna_size, stop_at);
+	}
+
+	free(snaps);
+	return resumed;
+}
+
+/*
+ * Prefix cache
+ *
+ * For search loops that keep rewriting the end of a long trace. The RNA is
+ * cut into fixed size blocks and the state at every block boundary is cached
+ * under the hash of the whole prefix before it, so a rerun can pick up at the
+ * last boundary whose prefix is unchanged. Nothing is ever evicted, the cache
+ * dir is the caller's to clean up.
+ */
+static void prefix_cache_filename(char *out, size_t size, char *cache_dir, uint64_t hash) {
+	snprintf(out, size, "%s/%016llx.snap", cache_dir, (unsigned long long)hash);
+}
+
+static bool resume_from_prefix_cache(fuun_state_t *state, char *rna_buffer, size_t rna_size, char *cache_dir, int stop_at) {
+	int block_count = rna_size / PREFIX_BLOCK_SIZE;
+	if (!block_count) {
+		return false;
+	}
+
+	uint64_t *hashes = (uint64_t *)emalloc(sizeof(uint64_t) * block_count);
+	uint64_t hash = FNV_OFFSET;
+	for (int i = 0; i < block_count; i++) {
+		hash = hash_bytes(hash, rna_buffer + ((size_t)i * PREFIX_BLOCK_SIZE), PREFIX_BLOCK_SIZE);
+		hashes[i] = hash;
+	}
+
+	bool resumed = false;
+	for (int i = block_count - 1; i >= 0 && !resumed; i--) {
+		char filename[PATH_MAX];
+		prefix_cache_filename(filename, sizeof(filename), cache_dir, hashes[i]);
+		if (access(filename, R_OK) == 0) {
+			resumed = load_state_file(state, filename, rna_buffer, rna_size, stop_at);
+		}
+	}
+
+	free(hashes);
+	return resumed;
+}
+
+static void cache_prefix(snapshot_writer_t *sw, fuun_state_t *state, char *rna_buffer, char *cache_dir) {
+	char filename[PATH_MAX];
+	prefix_cache_filename(filename, sizeof(filename), cache_dir, prefix_hash(state, rna_buffer));
+	if (access(filename, F_OK) == 0) {
+		return;
+	}
+
+	queue_snapshot(sw, state, rna_buffer, filename);
+}
+
+/*
+ * Frame output
+ *
+ * Frames are the flattened layer stack at some point in the trace. The
+ * interpreter only diffs each frame against the previous one and hands the
+ * changed rows to an encoder thread, which keeps its own copy of the frame,
+ * patches it and does the slow PNG encode + write off the hot path.
+ *
+ * The deltas only keep the hand-off cheap. Every frame still goes to disk as
+ * a whole PNG, so any one of them opens on its own and the lot can go
+ * straight to a video encoder.
+ */
+typedef struct {
+	int frame_no;
+	int inst_count;
+
+	int row_count;
+	uint16_t *rows;
+	color_t *pixels;
+} frame_delta_t;
+
+typedef struct {
+	char *frame_dir;
+	int frame_every;
+	bool frame_on_compose;
+
+	int frame_count;
+	color_t *last_frame;
+	color_t *scratch;
+
+	pthread_t encoder;
+	ring_t ring;
+} frame_writer_t;
+
+static void flatten_layers(fuun_state_t *state, color_t *out) {
+	layer_to_rgba(state->bitmaps[0], out);
+
+	for (int i = 1; i < state->bitmap_size; i++) {
+		layer_t *below = state->bitmaps[i];
+		for (int t = 0; t < TILE_COUNT; t++) {
+			if (below->tiles[t] == &zero_tile) {
+				continue;
+			}
+
+			color_t *below_px = below->tiles[t]->px;
+			int base_x = (t % TILES_X) * TILE_SIZE;
+			int base_y = (t / TILES_X) * TILE_SIZE;
+			for (int j = 0; j < TILE_PIXELS; j++) {
+				color_t *px = out + ((base_y + tile_px_y(j)) * BITMAP_WIDTH) + base_x + tile_px_x(j);
+				*px = compose_px(*px, below_px[j]);
+			}
+		}
+	}
+}
+
+static void *frame_encoder_main(void *arg) {
+	frame_writer_t *fw = (frame_writer_t *)arg;
+	color_t *frame = (color_t *)ecalloc(sizeof(color_t), BITMAP_WIDTH * BITMAP_HEIGHT);
+
+	frame_delta_t *delta;
+	while ((delta = (frame_delta_t *)ring_pop(&fw->ring)) != NULL) {
+		for (int i = 0; i < delta->row_count; i++) {
+			memcpy(frame + (delta->rows[i] * BITMAP_WIDTH), delta->pixels + (i * BITMAP_WIDTH), sizeof(color_t) * BITMAP_WIDTH);
+		}
+
+		char filename[PATH_MAX];
+		snprintf(filename, sizeof(filename), "%s/frame_%06d.png", fw->frame_dir, delta->frame_no);
+		if (!stbi_write_png(filename, BITMAP_WIDTH, BITMAP_HEIGHT, 4, frame, BITMAP_WIDTH * 4)) {
+			panic("Failed to write frame %s\n", filename);
+		}
+		trace("Wrote frame %s (inst %d, %d rows changed)\n", filename, delta->inst_count, delta->row_count);
+
+		free(delta->rows);
+		free(delta->pixels);
+		free(delta);
+	}
+
+	free(frame);
+	return NULL;
+}
+
+static void start_frame_writer(frame_writer_t *fw) {
+	make_dir(fw->frame_dir);
+
+	fw->last_frame = (color_t *)ecalloc(sizeof(color_t), BITMAP_WIDTH * BITMAP_HEIGHT);
+	fw->scratch = (color_t *)emalloc(sizeof(color_t) * BITMAP_WIDTH * BITMAP_HEIGHT);
+
+	ring_init(&fw->ring);
+
+	if (pthread_create(&fw->encoder, NULL, frame_encoder_main, fw) != 0) {
+		panic("Failed to start the frame encoder thread!\n");
+	}
+}
+
+static void emit_frame(frame_writer_t *fw, fuun_state_t *state) {
+	flatten_layers(state, fw->scratch);
+
+	// Both the interpreter and the encoder start from an all-zero frame, so only changed rows need to cross over
+	frame_delta_t *delta = (frame_delta_t *)ecalloc(1, sizeof(frame_delta_t));
+	delta->frame_no = fw->frame_count++;
+	delta->inst_count = state->inst_count;
+	delta->rows = (uint16_t *)emalloc(sizeof(uint16_t) * BITMAP_HEIGHT);
+
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		color_t *new_row = fw->scratch + (y * BITMAP_WIDTH);
+		color_t *old_row = fw->last_frame + (y * BITMAP_WIDTH);
+		if (memcmp(new_row, old_row, sizeof(color_t) * BITMAP_WIDTH) != 0) {
+			memcpy(old_row, new_row, sizeof(color_t) * BITMAP_WIDTH);
+			delta->rows[delta->row_count++] = y;
+		}
+	}
+
+	delta->pixels = (color_t *)emalloc(sizeof(color_t) * BITMAP_WIDTH * max(delta->row_count, 1));
+	for (int i = 0; i < delta->row_count; i++) {
+		memcpy(delta->pixels + (i * BITMAP_WIDTH), fw->last_frame + (delta->rows[i] * BITMAP_WIDTH), sizeof(color_t) * BITMAP_WIDTH);
+	}
+
+	ring_push(&fw->ring, delta);
+}
+
+static void finish_frame_writer(frame_writer_t *fw) {
+	ring_close(&fw->ring);
+	pthread_join(fw->encoder, NULL);
+	printf("Wrote %d frames to %s\n", fw->frame_count, fw->frame_dir);
+
+	free(fw->last_frame);
+	free(fw->scratch);
+}
+
+/*
+ * Draw lists
+ *
+ * RNA never branches, so everything except what's in the bitmaps is known
+ * before a trace runs: where the cursor and mark are, what color the bucket
+ * mixes to and how deep the bitmap stack is. Resolving a program walks it
+ * once to work all of that out and leaves a flat list of draws with their
+ * coordinates and colors filled in, plus the bitmap stack ops. No cursor or
+ * bucket ops are left, just a couple of draws at the end that put the cursor
+ * and bucket where the trace leaves them.
+ */
+typedef enum {
+	DRAW_LINE,        // x0, y0, x1, y1, color
+	DRAW_FILL,        // x, y, color
+	DRAW_ADD_BITMAP,
+	DRAW_COMPOSE,
+	DRAW_CLIP,
+	DRAW_DISCARD,
+	DRAW_CLEAR_BUCKET,
+	DRAW_ADD_COLOR,   // index into base_colors
+	DRAW_SET_CURSOR,  // pos_x, pos_y, mark_x, mark_y, dir
+} draw_code_t;
+
+#define DRAW_MAX_ARGS 5
+
+typedef struct {
+	uint8_t code;
+	int args[DRAW_MAX_ARGS];
+} draw_t;
+
+typedef struct {
+	draw_t *draws;
+	int len;
+	int cap;
+
+	int op_count;     // ops that got resolved, the interpreter carries on from there
+	int inst_count;
+	size_t rna_pos;
+} draw_list_t;
+
+static void k_line(fuun_state_t *state, int x0, int y0, int x1, int y1, uint32_t col) {
+	color_t color;
+	color.c = col;
+	draw_line(state->bitmaps[0], x0, y0, x1, y1, color);
+}
+
+static void k_fill(fuun_state_t *state, int x, int y, uint32_t col) {
+	color_t color;
+	color.c = col;
+	fill_bitmap(state, x, y, color);
+}
+
+static void k_clear_bucket(fuun_state_t *state) {
+	memset(state->bucket, 0, sizeof(color_wrap_t) * state->bucket_len);
+	state->bucket_len = 0;
+}
+
+static void k_add_color(fuun_state_t *state, int color_idx) {
+	add_color(state, *base_colors[color_idx]);
+}
+
+static void k_set_cursor(fuun_state_t *state, int pos_x, int pos_y, int mark_x, int mark_y, int dir) {
+	state->pos_x = pos_x;
+	state->pos_y = pos_y;
+	state->mark_x = mark_x;
+	state->mark_y = mark_y;
+	state->dir = (dir_t)dir;
+}
+
+// The function each draw turns into, and how it gets written out
+typedef struct {
+	char *name;
+	char *kernel;
+	void *fn;
+	int arg_count;
+	int color_arg;    // which argument is a packed color, or -1
+} draw_info_t;
+
+static const draw_info_t draw_info[] = {
+	{ "line",         "k_line",          (void *)k_line,          5,  4 },
+	{ "fill",         "k_fill",          (void *)k_fill,          3,  2 },
+	{ "add_bitmap",   "push_bitmap",     (void *)push_bitmap,     0, -1 },
+	{ "compose",      "compose_bitmaps", (void *)compose_bitmaps, 0, -1 },
+	{ "clip",         "clip_bitmaps",    (void *)clip_bitmaps,    0, -1 },
+	{ "discard",      "pop_bitmap",      (void *)pop_bitmap,      0, -1 },
+	{ "clear_bucket", "k_clear_bucket",  (void *)k_clear_bucket,  0, -1 },
+	{ "add_color",    "k_add_color",     (void *)k_add_color,     1, -1 },
+	{ "set_cursor",   "k_set_cursor",    (void *)k_set_cursor,    5, -1 },
+};
+
+static void push_draw(draw_list_t *dl, draw_code_t code, int a, int b, int c, int d, int e) {
+	if (dl->len == dl->cap) {
+		dl->cap = max(dl->cap * 2, 1024);
+		dl->draws = (draw_t *)erealloc(dl->draws, sizeof(draw_t) * dl->cap);
+	}
+
+	draw_t *draw = &dl->draws[dl->len++];
+	draw->code = code;
+	draw->args[0] = a;
+	draw->args[1] = b;
+	draw->args[2] = c;
+	draw->args[3] = d;
+	draw->args[4] = e;
+}
+
+// Resolves ops from the start of prog until stop_at, for a run starting from state
+static void resolve_draws(draw_list_t *dl, prog_t *prog, fuun_state_t *state, int stop_at) {
+	memset(dl, 0, sizeof(draw_list_t));
+
+	// The cursor and bucket ops run ahead of time on a copy of the state without any bitmaps
+	fuun_state_t sim = *state;
+	sim.bitmaps = NULL;
+	sim.fill_stack = NULL;
+	sim.arena = NULL;
+	sim.bucket = (color_wrap_t *)emalloc(sizeof(color_wrap_t) * state->max_colors);
+	memcpy(sim.bucket, state->bucket, sizeof(color_wrap_t) * state->max_colors);
+
+	int last_clear = -1;
+
+	int i = 0;
+	for (; i < prog->len; i++) {
+		if (stop_at >= 0 && sim.inst_count >= stop_at) {
+			break;
+		}
+
+		op_t *op = &prog->ops[i];
+		switch (op->code) {
+			case OP_LINE: {
+				push_draw(dl, DRAW_LINE, sim.pos_x, sim.pos_y, sim.mark_x, sim.mark_y, get_cur_col(&sim).c);
+			} break;
+			case OP_FILL: {
+				push_draw(dl, DRAW_FILL, sim.pos_x, sim.pos_y, get_cur_col(&sim).c, 0, 0);
+			} break;
+			case OP_ADD_BITMAP: {
+				if (sim.bitmap_size < sim.max_bitmaps) {
+					push_draw(dl, DRAW_ADD_BITMAP, 0, 0, 0, 0, 0);
+					sim.bitmap_size++;
+				}
+			} break;
+			case OP_COMPOSE:
+			case OP_CLIP:
+			case OP_DISCARD:
+			case OP_MERGE: {
+				// Draw lists keep every merge as its own draw
+				int count = (op->code == OP_MERGE) ? op->arg : 1;
+				for (int j = 0; j < count && sim.bitmap_size >= 2; j++) {
+					int kind = (op->code == OP_MERGE) ? merge_kind(op, j) : op_merge_kind(op);
+					draw_code_t code = (kind == MERGE_COMPOSE) ? DRAW_COMPOSE : (kind == MERGE_CLIP) ? DRAW_CLIP : DRAW_DISCARD;
+					push_draw(dl, code, 0, 0, 0, 0, 0);
+					sim.bitmap_size--;
+				}
+			} break;
+			case OP_CLEAR_BUCKET: {
+				last_clear = i;
+				exec_op(&sim, op);
+			} break;
+			default: {
+				exec_op(&sim, op);
+			} break;
+		}
+
+		sim.inst_count += op->count;
+		sim.rna_pos = op->rna_end;
+	}
+
+	// Only the colors added since the last clear are still in the bucket at the end
+	if (last_clear >= 0) {
+		push_draw(dl, DRAW_CLEAR_BUCKET, 0, 0, 0, 0, 0);
+	}
+	for (int j = last_clear + 1; j < i; j++) {
+		if (prog->ops[j].code == OP_ADD_COLOR) {
+			push_draw(dl, DRAW_ADD_COLOR, prog->ops[j].arg, 0, 0, 0, 0);
+		}
+	}
+	push_draw(dl, DRAW_SET_CURSOR, sim.pos_x, sim.pos_y, sim.mark_x, sim.mark_y, sim.dir);
+
+	dl->op_count = i;
+	dl->inst_count = sim.inst_count;
+	dl->rna_pos = sim.rna_pos;
+
+	free(sim.bucket);
+}
+
+static void run_draw(fuun_state_t *state, draw_t *draw) {
+	int *args = draw->args;
+	switch (draw->code) {
+		case DRAW_LINE: {
+			k_line(state, args[0], args[1], args[2], args[3], args[4]);
+		} break;
+		case DRAW_FILL: {
+			k_fill(state, args[0], args[1], args[2]);
+		} break;
+		case DRAW_ADD_BITMAP: {
+			push_bitmap(state);
+		} break;
+		case DRAW_COMPOSE: {
+			compose_bitmaps(state);
+		} break;
+		case DRAW_CLIP: {
+			clip_bitmaps(state);
+		} break;
+		case DRAW_DISCARD: {
+			pop_bitmap(state);
+		} break;
+		case DRAW_CLEAR_BUCKET: {
+			k_clear_bucket(state);
+		} break;
+		case DRAW_ADD_COLOR: {
+			k_add_color(state, args[0]);
+		} break;
+		case DRAW_SET_CURSOR: {
+			k_set_cursor(state, args[0], args[1], args[2], args[3], args[4]);
+		} break;
+		default: {
+			panic("Unhandled draw: %d\n", draw->code);
+		}
+	}
+}
+
+static void run_draws(fuun_state_t *state, draw_list_t *dl) {
+	for (int i = 0; i < dl->len; i++) {
+		run_draw(state, &dl->draws[i]);
+	}
+
+	state->inst_count = dl->inst_count;
+	state->rna_pos = dl->rna_pos;
+}
+
+// One draw per line, so two traces can be compared with diff
+static void write_draw_list(draw_list_t *dl, char *filename, char *rna_filename) {
+	FILE *out = fopen(filename, "w");
+	if (out == NULL) {
+		panic("Failed to open %s\n", filename);
+	}
+
+	fprintf(out, "# %s: %d instructions, %d draws\n", rna_filename, dl->inst_count, dl->len);
+	for (int i = 0; i < dl->len; i++) {
+		draw_t *draw = &dl->draws[i];
+		const draw_info_t *info = &draw_info[draw->code];
+		fprintf(out, "%s", info->name);
+		for (int a = 0; a < info->arg_count; a++) {
+			if (a == info->color_arg) {
+				fprintf(out, " %08x", (uint32_t)draw->args[a]);
+			} else {
+				fprintf(out, " %d", draw->args[a]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+
+	if (fclose(out) != 0) {
+		panic("Failed to write %s\n", filename);
+	}
+}
+
+/*
+ * Compiled traces
+ *
+ * A draw list is already straight-line code, so it compiles to one call per
+ * draw with constant arguments. The calls either become x86-64 machine code
+ * on the spot (-J), or get written out as C that builds into a renderer for
+ * just that trace (-C).
+ */
+typedef struct {
+	draw_list_t *draws;
+	void *code;       // NULL if the draws couldn't be jitted
+	size_t code_size;
+} compiled_t;
+
+#ifdef __x86_64__
+static void emit_u8(byte_buf_t *buf, uint8_t val) {
+	buf_write(buf, &val, sizeof(val));
+}
+
+// mov esi/edx/ecx/r8d/r9d, imm32 for the arguments after the state, in order
+static const uint8_t jit_arg_rex[DRAW_MAX_ARGS] = { 0x00, 0x00, 0x00, 0x41, 0x41 };
+static const uint8_t jit_arg_mov[DRAW_MAX_ARGS] = { 0xBE, 0xBA, 0xB9, 0xB8, 0xB9 };
+
+// Turns the draws into one function taking the state, false if the code can't be made executable
+static bool jit_compile(compiled_t *ct) {
+	byte_buf_t buf = {0};
+
+	// push rbx; mov rbx, rdi. The state stays in rbx across calls, and the push leaves the stack 16 byte aligned for them
+	emit_u8(&buf, 0x53);
+	emit_u8(&buf, 0x48); emit_u8(&buf, 0x89); emit_u8(&buf, 0xFB);
+
+	for (int i = 0; i < ct->draws->len; i++) {
+		draw_t *draw = &ct->draws->draws[i];
+		const draw_info_t *info = &draw_info[draw->code];
+
+		for (int a = 0; a < info->arg_count; a++) {
+			if (jit_arg_rex[a]) {
+				emit_u8(&buf, jit_arg_rex[a]);
+			}
+			emit_u8(&buf, jit_arg_mov[a]);
+			buf_u32(&buf, (uint32_t)draw->args[a]);
+		}
+
+		// mov rdi, rbx; mov rax, kernel; call rax
+		emit_u8(&buf, 0x48); emit_u8(&buf, 0x89); emit_u8(&buf, 0xDF);
+		emit_u8(&buf, 0x48); emit_u8(&buf, 0xB8);
+		buf_u64(&buf, (uint64_t)(uintptr_t)info->fn);
+		emit_u8(&buf, 0xFF); emit_u8(&buf, 0xD0);
+	}
+
+	// pop rbx; ret
+	emit_u8(&buf, 0x5B);
+	emit_u8(&buf, 0xC3);
+
+	void *code = mmap(NULL, buf.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		free(buf.data);
+		return false;
+	}
+
+	memcpy(code, buf.data, buf.size);
+	free(buf.data);
+
+	if (mprotect(code, buf.size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(code, buf.size);
+		return false;
+	}
+
+	ct->code = code;
+	ct->code_size = buf.size;
+	return true;
+}
+#else
+static bool jit_compile(compiled_t *ct) {
+	return false;
+}
+#endif
+
+static void run_compiled(fuun_state_t *state, compiled_t *ct) {
+	if (ct->code == NULL) {
+		run_draws(state, ct->draws);
+		return;
+	}
+
+	((void (*)(fuun_state_t *))ct->code)(state);
+	state->inst_count = ct->draws->inst_count;
+	state->rna_pos = ct->draws->rna_pos;
+}
+
+static void free_compiled(compiled_t *ct) {
+	if (ct->code) {
+		munmap(ct->code, ct->code_size);
+	}
+}
+
+// Each generated function gets this many calls, compilers get slow on really long functions
+#define COMPILED_CALLS_PER_PART 4096
+
+static void write_compiled_c(draw_list_t *dl, char *filename, char *rna_filename) {
+	FILE *out = fopen(filename, "w");
+	if (out == NULL) {
+		panic("Failed to open %s\n", filename);
+	}
+
+	fprintf(out, "// Generated by endo -C from %s, %d instructions starting from a fresh state\n", rna_filename, dl->inst_count);
+	fprintf(out, "// Build it from the directory main.c is in: clang -O2 -o trace %s -lm -lpthread\n", filename);
+	fprintf(out, "#define ENDO_COMPILED_TRACE\n");
+	fprintf(out, "#include \"main.c\"\n");
+
+	int part_count = (dl->len + COMPILED_CALLS_PER_PART - 1) / COMPILED_CALLS_PER_PART;
+	for (int i = 0; i < dl->len; i++) {
+		if ((i % COMPILED_CALLS_PER_PART) == 0) {
+			fprintf(out, "%s\nstatic void trace_part_%d(fuun_state_t *state) {\n", i ? "}\n" : "", i / COMPILED_CALLS_PER_PART);
+		}
+
+		draw_t *draw = &dl->draws[i];
+		const draw_info_t *info = &draw_info[draw->code];
+		fprintf(out, "\t%s(state", info->kernel);
+		for (int a = 0; a < info->arg_count; a++) {
+			if (a == info->color_arg) {
+				fprintf(out, ", 0x%08xu", (uint32_t)draw->args[a]);
+			} else {
+				fprintf(out, ", %d", draw->args[a]);
+			}
+		}
+		fprintf(out, ");\n");
+	}
+	if (part_count) {
+		fprintf(out, "}\n");
+	}
+
+	fprintf(out, "\nstatic void run_compiled_trace(fuun_state_t *state) {\n");
+	for (int i = 0; i < part_count; i++) {
+		fprintf(out, "\ttrace_part_%d(state);\n", i);
+	}
+	fprintf(out, "\tstate->inst_count = %d;\n", dl->inst_count);
+	fprintf(out, "\tstate->rna_pos = %zu;\n", dl->rna_pos);
+	fprintf(out, "}\n");
+
+	if (fclose(out) != 0) {
+		panic("Failed to write %s\n", filename);
+	}
+}
+
+/*
+ * Parallel layers
+ *
+ * Drawing into a bitmap never reads any other bitmap, so a draw list splits
+ * into segments: a run of draws into one bitmap, maybe starting with the
+ * COMPOSE or CLIP that merges the bitmap above it in. A segment waits for the
+ * segment before it on the same bitmap, and a merge also waits for the last
+ * segment of the bitmap it merges in, but nothing else orders them. Every
+ * segment goes to the pool as soon as what it waits for is done, so bitmaps
+ * that are drawn at the same time render on different cores. Every bitmap
+ * gets its own layer for the run, so no two segments ever share one.
+ */
+typedef struct layer_run layer_run_t;
+
+typedef struct {
+	layer_run_t *run;
+	int layer;
+	int merge_from;      // bitmap merged in before drawing, -1 if none
+	uint8_t merge_code;  // DRAW_COMPOSE, DRAW_CLIP or DRAW_DISCARD
+	int first_draw;
+	int end_draw;
+
+	int waiting;         // segments that have to finish before this one can run
+	int next[2];         // segments waiting on this one
+	int next_count;
+} segment_t;
+
+struct layer_run {
+	draw_list_t *draws;
+
+	segment_t *segments;
+	int segment_count;
+
+	layer_t **layers;       // one per bitmap, by id
+	fuun_state_t *workers;  // one per pool slot, they only lend their fill stack
+
+	pool_t *pool;
+	task_group_t group;
+};
+
+static int new_segment(layer_run_t *run, int *last_segment, int layer, int merge_from, uint8_t merge_code, int first_draw) {
+	int idx = run->segment_count++;
+	segment_t *seg = &run->segments[idx];
+	memset(seg, 0, sizeof(segment_t));
+	seg->run = run;
+	seg->layer = layer;
+	seg->merge_from = merge_from;
+	seg->merge_code = merge_code;
+	seg->first_draw = first_draw;
+	seg->end_draw = first_draw;
+
+	int deps[2] = { last_segment[layer], (merge_from >= 0) ? last_segment[merge_from] : -1 };
+	for (int i = 0; i < 2; i++) {
+		if (deps[i] >= 0) {
+			segment_t *dep = &run->segments[deps[i]];
+			dep->next[dep->next_count++] = idx;
+			seg->waiting++;
+		}
+	}
+
+	last_segment[layer] = idx;
+	return idx;
+}
+
+static void run_segment(void *arg, int slot) {
+	segment_t *seg = (segment_t *)arg;
+	layer_run_t *run = seg->run;
+
+	if (seg->merge_from >= 0) {
+		layer_t *top = run->layers[seg->merge_from];
+		if (seg->merge_code == DRAW_COMPOSE) {
+			compose_layers(top, run->layers[seg->layer]);
+		} else if (seg->merge_code == DRAW_CLIP) {
+			clip_layers(top, run->layers[seg->layer]);
+		}
+
+		free_layer(top);
+		run->layers[seg->merge_from] = NULL;
+	}
+
+	fuun_state_t *worker = &run->workers[slot];
+	worker->bitmaps = &run->layers[seg->layer];
+	for (int i = seg->first_draw; i < seg->end_draw; i++) {
+		run_draw(worker, &run->draws->draws[i]);
+	}
+
+	for (int i = 0; i < seg->next_count; i++) {
+		segment_t *next = &run->segments[seg->next[i]];
+		if (__atomic_sub_fetch(&next->waiting, 1, __ATOMIC_ACQ_REL) == 0) {
+			pool_submit(run->pool, &run->group, run_segment, next);
+		}
+	}
+}
+
+// Runs the draw list with independent bitmaps drawn in parallel, ending up with the same state as run_draws
+static void run_draws_parallel(fuun_state_t *state, draw_list_t *dl, int worker_count) {
+	layer_run_t run = {0};
+	run.draws = dl;
+	run.segments = (segment_t *)emalloc(sizeof(segment_t) * max(dl->len, 1));
+
+	int depth = state->bitmap_size;
+	int layer_count = depth;
+	for (int i = 0; i < dl->len; i++) {
+		layer_count += (dl->draws[i].code == DRAW_ADD_BITMAP);
+	}
+
+	run.layers = (layer_t **)ecalloc(layer_count, sizeof(layer_t *));
+	int *last_segment = (int *)emalloc(sizeof(int) * layer_count);
+	int *stack = (int *)emalloc(sizeof(int) * state->max_bitmaps);
+	for (int i = 0; i < layer_count; i++) {
+		last_segment[i] = -1;
+	}
+	for (int i = 0; i < depth; i++) {
+		stack[i] = i;
+		run.layers[i] = new_layer(state->arena);
+		copy_layer(run.layers[i], state->bitmaps[i]);
+	}
+
+	int next_id = depth;
+	int open = -1;
+	for (int i = 0; i < dl->len; i++) {
+		draw_t *draw = &dl->draws[i];
+		switch (draw->code) {
+			case DRAW_LINE:
+			case DRAW_FILL: {
+				if (open < 0) {
+					open = new_segment(&run, last_segment, stack[0], -1, 0, i);
+				}
+				run.segments[open].end_draw = i + 1;
+			} break;
+			case DRAW_ADD_BITMAP: {
+				memmove(stack + 1, stack, sizeof(int) * depth);
+				depth++;
+
+				stack[0] = next_id;
+				run.layers[next_id] = new_layer(state->arena);
+				next_id++;
+				open = -1;
+			} break;
+			case DRAW_COMPOSE:
+			case DRAW_CLIP:
+			case DRAW_DISCARD: {
+				open = new_segment(&run, last_segment, stack[1], stack[0], draw->code, i + 1);
+
+				depth--;
+				memmove(stack, stack + 1, sizeof(int) * depth);
+			} break;
+		}
+	}
+
+	run.pool = pool_create(worker_count);
+	run.workers = (fuun_state_t *)ecalloc(run.pool->worker_count + 1, sizeof(fuun_state_t));
+	for (int i = 0; i <= run.pool->worker_count; i++) {
+		run.workers[i].max_fill_stack = FILL_STACK_SIZE;
+	}
+
+	trace("Running %d draws as %d segments over %d bitmaps on %d workers\n", dl->len, run.segment_count, layer_count, run.pool->worker_count);
+
+	for (int i = 0; i < run.segment_count; i++) {
+		if (run.segments[i].waiting == 0) {
+			pool_submit(run.pool, &run.group, run_segment, &run.segments[i]);
+		}
+	}
+	pool_wait(run.pool, &run.group);
+
+	for (int i = 0; i < state->max_bitmaps; i++) {
+		if (i < depth) {
+			copy_layer(state->bitmaps[i], run.layers[stack[i]]);
+		} else {
+			clear_layer(state->bitmaps[i]);
+		}
+	}
+	state->bitmap_size = depth;
+
+	// The bucket and cursor draws at the end only touch the state
+	for (int i = 0; i < dl->len; i++) {
+		uint8_t code = dl->draws[i].code;
+		if (code == DRAW_CLEAR_BUCKET || code == DRAW_ADD_COLOR || code == DRAW_SET_CURSOR) {
+			run_draw(state, &dl->draws[i]);
+		}
+	}
+	state->inst_count = dl->inst_count;
+	state->rna_pos = dl->rna_pos;
+
+	for (int i = 0; i <= run.pool->worker_count; i++) {
+		free(run.workers[i].fill_stack);
+	}
+	pool_destroy(run.pool);
+
+	for (int i = 0; i < layer_count; i++) {
+		if (run.layers[i]) {
+			free_layer(run.layers[i]);
+		}
+	}
+	free(run.workers);
+	free(stack);
+	free(last_segment);
+	free(run.layers);
+	free(run.segments);
+}
+
+/*
+ * Run-length layers
+ *
+ * Endo's images are mostly big flat areas between lines, so with -L the draw
+ * list renders onto bitmaps that keep every row as a list of runs instead of
+ * pixels. Fills replace runs, and compose and clip walk two rows of runs side
+ * by side, so they cost as much as the number of edges instead of the area.
+ * Neighbouring runs never have the same color. The stack only turns back
+ * into tiled layers once it's done.
+ */
+typedef struct {
+	uint16_t end;  // exclusive, the run starts where the one before it ends
+	color_t col;
+} run_t;
+
+typedef struct {
+	run_t *runs;
+	int len;
+	int cap;
+} rle_row_t;
+
+typedef struct {
+	rle_row_t rows[BITMAP_HEIGHT];
+} rle_layer_t;
+
+static void row_push(rle_row_t *row, int end, color_t col) {
+	if (row->len && row->runs[row->len - 1].col.c == col.c) {
+		row->runs[row->len - 1].end = end;
+		return;
+	}
+
+	if (row->len == row->cap) {
+		row->cap = max(row->cap * 2, 4);
+		row->runs = (run_t *)erealloc(row->runs, sizeof(run_t) * row->cap);
+	}
+	row->runs[row->len].end = end;
+	row->runs[row->len].col = col;
+	row->len++;
+}
+
+static void swap_rows(rle_row_t *a, rle_row_t *b) {
+	rle_row_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static rle_layer_t *new_rle_layer(void) {
+	rle_layer_t *layer = (rle_layer_t *)ecalloc(1, sizeof(rle_layer_t));
+	color_t clear = {0};
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		row_push(&layer->rows[y], BITMAP_WIDTH, clear);
+	}
+	return layer;
+}
+
+static void free_rle_layer(rle_layer_t *layer) {
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		free(layer->rows[y].runs);
+	}
+	free(layer);
+}
+
+// Index of the run x is in
+static int row_find(rle_row_t *row, int x) {
+	int lo = 0;
+	int hi = row->len - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->runs[mid].end > x) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+// Paints [x0, x1) of a row, scratch comes back holding whatever it gets swapped for
+static void row_set(rle_row_t *row, rle_row_t *scratch, int x0, int x1, color_t col) {
+	run_t *hit = &row->runs[row_find(row, x0)];
+	if (hit->col.c == col.c && hit->end >= x1) {
+		return;
+	}
+
+	scratch->len = 0;
+
+	bool placed = false;
+	int start = 0;
+	for (int i = 0; i < row->len; i++) {
+		run_t run = row->runs[i];
+		if (start < x0) {
+			row_push(scratch, min(run.end, x0), run.col);
+		}
+		if (run.end > x1) {
+			if (!placed) {
+				row_push(scratch, x1, col);
+				placed = true;
+			}
+			row_push(scratch, run.end, run.col);
+		}
+		start = run.end;
+	}
+	if (!placed) {
+		row_push(scratch, x1, col);
+	}
+
+	swap_rows(row, scratch);
+}
+
+typedef struct {
+	rle_row_t scratch;
+	int max_seeds;
+	pos_t *seeds;
+} rle_ctx_t;
+
+// Same stepping as draw_line
+static void rle_line(rle_ctx_t *ctx, rle_layer_t *layer, int x0, int y0, int x1, int y1, color_t col) {
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	int d = max(abs(dx), abs(dy));
+
+	int c = ((dx * dy) <= 0) ? 1 : 0;
+
+	int offset = (d - c) / 2;
+	int x = x0 * d + offset;
+	int y = y0 * d + offset;
+
+	for (int j = 0; j < d; j++) {
+		int px_x = x / d;
+		row_set(&layer->rows[y / d], &ctx->scratch, px_x, px_x + 1, col);
+
+		x += dx;
+		y += dy;
+	}
+
+	row_set(&layer->rows[y1], &ctx->scratch, x1, x1 + 1, col);
+}
+
+static void rle_push_seed(rle_ctx_t *ctx, int *seed_count, int x, int y) {
+	if (*seed_count == ctx->max_seeds) {
+		ctx->max_seeds = max(ctx->max_seeds * 2, 1024);
+		ctx->seeds = (pos_t *)erealloc(ctx->seeds, sizeof(pos_t) * ctx->max_seeds);
+	}
+	ctx->seeds[*seed_count].x = x;
+	ctx->seeds[*seed_count].y = y;
+	(*seed_count)++;
+}
+
+// Pushes a seed for every run on row y between x0 and x1 that still needs filling
+static void rle_push_row(rle_ctx_t *ctx, int *seed_count, rle_row_t *row, int x0, int x1, int y, color_t col) {
+	int start = 0;
+	for (int i = 0; i < row->len && start < x1; i++) {
+		if (row->runs[i].end > x0 && row->runs[i].col.c != col.c) {
+			rle_push_seed(ctx, seed_count, max(start, x0), y);
+		}
+		start = row->runs[i].end;
+	}
+}
+
+// Same region as fill_bitmap, everything connected to the seed that isn't col yet
+static void rle_fill(rle_ctx_t *ctx, rle_layer_t *layer, int x, int y, color_t col) {
+	int seed_count = 0;
+	rle_push_seed(ctx, &seed_count, x, y);
+
+	while (seed_count > 0) {
+		pos_t seed = ctx->seeds[--seed_count];
+		rle_row_t *row = &layer->rows[seed.y];
+
+		int first = row_find(row, seed.x);
+		if (row->runs[first].col.c == col.c) {
+			continue;
+		}
+
+		int last = first;
+		while (first > 0 && row->runs[first - 1].col.c != col.c) {
+			first--;
+		}
+		while (last < (row->len - 1) && row->runs[last + 1].col.c != col.c) {
+			last++;
+		}
+
+		int x0 = first ? row->runs[first - 1].end : 0;
+		int x1 = row->runs[last].end;
+		row_set(row, &ctx->scratch, x0, x1, col);
+
+		if (seed.y > 0) {
+			rle_push_row(ctx, &seed_count, &layer->rows[seed.y - 1], x0, x1, seed.y - 1, col);
+		}
+		if (seed.y < (BITMAP_HEIGHT - 1)) {
+			rle_push_row(ctx, &seed_count, &layer->rows[seed.y + 1], x0, x1, seed.y + 1, col);
+		}
+	}
+}
+
+// Compose (or clip) top into below a row at a time, one output run per pair of overlapping runs
+static void rle_merge(rle_ctx_t *ctx, rle_layer_t *top, rle_layer_t *below, bool clip) {
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		rle_row_t *top_row = &top->rows[y];
+		rle_row_t *below_row = &below->rows[y];
+
+		// A row of transparent black composes to nothing, clipping to it clears the row
+		if (top_row->len == 1 && top_row->runs[0].col.c == 0) {
+			if (clip) {
+				below_row->len = 0;
+				row_push(below_row, BITMAP_WIDTH, top_row->runs[0].col);
+			}
+			continue;
+		}
+
+		rle_row_t *out = &ctx->scratch;
+		out->len = 0;
+
+		int i = 0;
+		int j = 0;
+		while (i < top_row->len && j < below_row->len) {
+			run_t t = top_row->runs[i];
+			run_t b = below_row->runs[j];
+			row_push(out, min(t.end, b.end), clip ? clip_px(t.col, b.col) : compose_px(t.col, b.col));
+			i += (t.end <= b.end);
+			j += (b.end <= t.end);
+		}
+
+		swap_rows(below_row, out);
+	}
+}
+
+static void layer_to_rle(layer_t *layer, rle_layer_t *out) {
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		rle_row_t *row = &out->rows[y];
+		row->len = 0;
+		for (int x = 0; x < BITMAP_WIDTH; x++) {
+			row_push(row, x + 1, layer_get(layer, x, y));
+		}
+	}
+}
+
+static void rle_to_layer(rle_layer_t *rle, layer_t *out) {
+	clear_layer(out);
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		rle_row_t *row = &rle->rows[y];
+		int start = 0;
+		for (int i = 0; i < row->len; i++) {
+			if (row->runs[i].col.c != 0) {
+				fill_span_t span = { y, start, row->runs[i].end };
+				fill_span(out, span, row->runs[i].col);
+			}
+			start = row->runs[i].end;
+		}
+	}
+}
+
+// Runs the draw list on run-length bitmaps, ending up with the same state as run_draws
+static void run_draws_rle(fuun_state_t *state, draw_list_t *dl) {
+	rle_ctx_t ctx = {0};
+	rle_layer_t **stack = (rle_layer_t **)emalloc(sizeof(rle_layer_t *) * state->max_bitmaps);
+
+	int depth = state->bitmap_size;
+	for (int i = 0; i < depth; i++) {
+		stack[i] = new_rle_layer();
+		layer_to_rle(state->bitmaps[i], stack[i]);
+	}
+
+	for (int i = 0; i < dl->len; i++) {
+		draw_t *draw = &dl->draws[i];
+		int *args = draw->args;
+		color_t col;
+		switch (draw->code) {
+			case DRAW_LINE: {
+				col.c = args[4];
+				rle_line(&ctx, stack[0], args[0], args[1], args[2], args[3], col);
+			} break;
+			case DRAW_FILL: {
+				col.c = args[2];
+				rle_fill(&ctx, stack[0], args[0], args[1], col);
+			} break;
+			case DRAW_ADD_BITMAP: {
+				memmove(stack + 1, stack, sizeof(rle_layer_t *) * depth);
+				stack[0] = new_rle_layer();
+				depth++;
+			} break;
+			case DRAW_COMPOSE:
+			case DRAW_CLIP:
+			case DRAW_DISCARD: {
+				if (draw->code != DRAW_DISCARD) {
+					rle_merge(&ctx, stack[0], stack[1], draw->code == DRAW_CLIP);
+				}
+				free_rle_layer(stack[0]);
+				depth--;
+				memmove(stack, stack + 1, sizeof(rle_layer_t *) * depth);
+			} break;
+			default: {
+				run_draw(state, draw);
+			} break;
+		}
+	}
+
+	for (int i = 0; i < state->max_bitmaps; i++) {
+		if (i < depth) {
+			rle_to_layer(stack[i], state->bitmaps[i]);
+			free_rle_layer(stack[i]);
+		} else {
+			clear_layer(state->bitmaps[i]);
+		}
+	}
+	state->bitmap_size = depth;
+	state->inst_count = dl->inst_count;
+	state->rna_pos = dl->rna_pos;
+
+	free(stack);
+	free(ctx.scratch.runs);
+	free(ctx.seeds);
+}
+
+/*
+ * Palette layers
+ *
+ * Every color in a trace is an average over the bucket or comes out of
+ * composing or clipping two such averages, so a render only ever sees a few
+ * hundred distinct colors. With -P the draw list renders onto bitmaps of 16
+ * bit indices into one palette for the whole render, half the bytes of RGBA.
+ * Compose and clip work on pairs of indices and remember what each pair came
+ * out as, so they never touch the colors themselves after the first time.
+ * Index 0 is always transparent black, what new bitmaps start out as. Only
+ * the stack that's left at the end gets expanded back out.
+ *
+ * A palette can run out. If the starting layers don't fit, -P doesn't happen,
+ * and if it runs out partway the stack gets expanded there and the rest of
+ * the draws run on the tiled layers.
+ */
+#define PALETTE_BITS  16
+#define PALETTE_MAX   (1 << PALETTE_BITS)
+#define PALETTE_SLOTS (PALETTE_MAX * 2)
+#define MERGE_MEMO_SLOTS 65536
+
+typedef struct {
+	color_t cols[PALETTE_MAX];
+	int len;
+	uint32_t slots[PALETTE_SLOTS];  // 1 + the index of the color hashed there, 0 if free
+
+	// Direct mapped, a key is clip << 32 | top << 16 | below with bit 33 set so 0 is never one
+	uint64_t memo_keys[MERGE_MEMO_SLOTS];
+	uint16_t memo_vals[MERGE_MEMO_SLOTS];
+} palette_t;
+
+typedef struct {
+	uint16_t px[BITMAP_WIDTH * BITMAP_HEIGHT];
+} pal_layer_t;
+
+typedef struct {
+	palette_t *pal;
+
+	int max_seeds;
+	pos_t *seeds;
+
+	// Cleared layers for ADD_BITMAP and merges to take, one more than the stack can hold
+	int spare_count;
+	pal_layer_t **spare;
+} pal_ctx_t;
+
+// Finds or adds col, false if the palette is full
+static bool pal_index(palette_t *pal, color_t col, uint16_t *idx) {
+	uint32_t slot = (col.c * 0x9E3779B1u) >> (31 - PALETTE_BITS);
+	while (pal->slots[slot]) {
+		uint32_t i = pal->slots[slot] - 1;
+		if (pal->cols[i].c == col.c) {
+			*idx = i;
+			return true;
+		}
+		slot = (slot + 1) & (PALETTE_SLOTS - 1);
+	}
+
+	if (pal->len == PALETTE_MAX) {
+		return false;
+	}
+	pal->cols[pal->len] = col;
+	pal->slots[slot] = ++pal->len;
+	*idx = pal->len - 1;
+	return true;
+}
+
+static bool pal_merge_px(palette_t *pal, uint16_t top, uint16_t below, bool clip, uint16_t *out) {
+	uint64_t key = (1ULL << 33) | ((uint64_t)clip << 32) | ((uint32_t)top << 16) | below;
+	uint32_t slot = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 48);
+	if (pal->memo_keys[slot] == key) {
+		*out = pal->memo_vals[slot];
+		return true;
+	}
+
+	color_t col = clip ? clip_px(pal->cols[top], pal->cols[below]) : compose_px(pal->cols[top], pal->cols[below]);
+	if (!pal_index(pal, col, out)) {
+		return false;
+	}
+	pal->memo_keys[slot] = key;
+	pal->memo_vals[slot] = *out;
+	return true;
+}
+
+static pal_layer_t *take_pal_layer(pal_ctx_t *ctx) {
+	return ctx->spare[--ctx->spare_count];
+}
+
+static void give_pal_layer(pal_ctx_t *ctx, pal_layer_t *layer) {
+	memset(layer->px, 0, sizeof(layer->px));
+	ctx->spare[ctx->spare_count++] = layer;
+}
+
+// Same stepping as draw_line
+static void pal_line(pal_layer_t *layer, int x0, int y0, int x1, int y1, uint16_t col) {
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	int d = max(abs(dx), abs(dy));
+
+	int c = ((dx * dy) <= 0) ? 1 : 0;
+
+	int offset = (d - c) / 2;
+	int x = x0 * d + offset;
+	int y = y0 * d + offset;
+
+	for (int j = 0; j < d; j++) {
+		layer->px[((y / d) * BITMAP_WIDTH) + (x / d)] = col;
+		x += dx;
+		y += dy;
+	}
+
+	layer->px[(y1 * BITMAP_WIDTH) + x1] = col;
+}
+
+static void pal_push_seed(pal_ctx_t *ctx, int *seed_count, int x, int y) {
+	if (*seed_count == ctx->max_seeds) {
+		ctx->max_seeds = max(ctx->max_seeds * 2, 1024);
+		ctx->seeds = (pos_t *)erealloc(ctx->seeds, sizeof(pos_t) * ctx->max_seeds);
+	}
+	ctx->seeds[*seed_count].x = x;
+	ctx->seeds[*seed_count].y = y;
+	(*seed_count)++;
+}
+
+// Pushes a seed for every stretch of row y between x0 and x1 that still needs filling
+static void pal_push_row(pal_ctx_t *ctx, int *seed_count, pal_layer_t *layer, int x0, int x1, int y, uint16_t col) {
+	uint16_t *row = layer->px + (y * BITMAP_WIDTH);
+	for (int x = x0; x < x1; x++) {
+		if (row[x] != col && (x == x0 || row[x - 1] == col)) {
+			pal_push_seed(ctx, seed_count, x, y);
+		}
+	}
+}
+
+// Same region as fill_bitmap, a span at a time
+static void pal_fill(pal_ctx_t *ctx, pal_layer_t *layer, int x, int y, uint16_t col) {
+	int seed_count = 0;
+	pal_push_seed(ctx, &seed_count, x, y);
+
+	while (seed_count > 0) {
+		pos_t seed = ctx->seeds[--seed_count];
+		uint16_t *row = layer->px + (seed.y * BITMAP_WIDTH);
+		if (row[seed.x] == col) {
+			continue;
+		}
+
+		int x0 = seed.x;
+		int x1 = seed.x + 1;
+		while (x0 > 0 && row[x0 - 1] != col) {
+			x0--;
+		}
+		while (x1 < BITMAP_WIDTH && row[x1] != col) {
+			x1++;
+		}
+		for (int i = x0; i < x1; i++) {
+			row[i] = col;
+		}
+
+		if (seed.y > 0) {
+			pal_push_row(ctx, &seed_count, layer, x0, x1, seed.y - 1, col);
+		}
+		if (seed.y < (BITMAP_HEIGHT - 1)) {
+			pal_push_row(ctx, &seed_count, layer, x0, x1, seed.y + 1, col);
+		}
+	}
+}
+
+// Compose (or clip) top into a copy of below, false and out half done if the palette runs out
+static bool pal_merge(palette_t *pal, pal_layer_t *top, pal_layer_t *below, pal_layer_t *out, bool clip) {
+	// Neighbouring pixels are mostly the same pair
+	uint16_t last_top = 0;
+	uint16_t last_below = 0;
+	uint16_t last = 0;
+	if (!pal_merge_px(pal, 0, 0, clip, &last)) {
+		return false;
+	}
+
+	for (int j = 0; j < BITMAP_WIDTH * BITMAP_HEIGHT; j++) {
+		uint16_t t = top->px[j];
+		uint16_t b = below->px[j];
+		if (t != last_top || b != last_below) {
+			if (!pal_merge_px(pal, t, b, clip, &last)) {
+				return false;
+			}
+			last_top = t;
+			last_below = b;
+		}
+		out->px[j] = last;
+	}
+	return true;
+}
+
+static bool layer_to_pal(palette_t *pal, layer_t *layer, pal_layer_t *out) {
+	for (int y = 0; y < BITMAP_HEIGHT; y++) {
+		for (int x = 0; x < BITMAP_WIDTH; x++) {
+			if (!pal_index(pal, layer_get(layer, x, y), &out->px[(y * BITMAP_WIDTH) + x])) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void pal_to_layer(palette_t *pal, pal_layer_t *in, layer_t *out) {
+	clear_layer(out);
+	for (int t = 0; t < TILE_COUNT; t++) {
+		int base_x = (t % TILES_X) * TILE_SIZE;
+		int base_y = (t / TILES_X) * TILE_SIZE;
+
+		// Tiles that are still all transparent black stay shared
+		bool clear = true;
+		for (int y = 0; y < TILE_SIZE && clear; y++) {
+			uint16_t *row = in->px + ((base_y + y) * BITMAP_WIDTH) + base_x;
+			for (int x = 0; x < TILE_SIZE; x++) {
+				clear &= (row[x] == 0);
+			}
+		}
+		if (clear) {
+			continue;
+		}
+
+		color_t *px = tile_mut(out, t)->px;
+		for (int y = 0; y < TILE_SIZE; y++) {
+			uint16_t *row = in->px + ((base_y + y) * BITMAP_WIDTH) + base_x;
+			for (int x = 0; x < TILE_SIZE; x++) {
+				px[tile_px_index(x, y)] = pal->cols[row[x]];
+			}
+		}
+	}
+}
+
+// Runs the draw list on palette bitmaps, ending up with the same state as run_draws. False if it couldn't start
+static bool run_draws_palette(fuun_state_t *state, draw_list_t *dl) {
+	pal_ctx_t ctx = {0};
+	ctx.pal = (palette_t *)ecalloc(1, sizeof(palette_t));
+	ctx.spare = (pal_layer_t **)emalloc(sizeof(pal_layer_t *) * (state->max_bitmaps + 1));
+	for (int i = 0; i <= state->max_bitmaps; i++) {
+		ctx.spare[ctx.spare_count++] = (pal_layer_t *)ecalloc(1, sizeof(pal_layer_t));
+	}
+	pal_layer_t **stack = (pal_layer_t **)emalloc(sizeof(pal_layer_t *) * state->max_bitmaps);
+
+	uint16_t clear;
+	pal_index(ctx.pal, (color_t){0}, &clear);
+
+	bool started = true;
+	int depth = state->bitmap_size;
+	for (int i = 0; i < depth; i++) {
+		stack[i] = take_pal_layer(&ctx);
+		started &= layer_to_pal(ctx.pal, state->bitmaps[i], stack[i]);
+	}
+
+	int i = 0;
+	for (; i < dl->len && started; i++) {
+		draw_t *draw = &dl->draws[i];
+		int *args = draw->args;
+		color_t col;
+		uint16_t idx;
+		bool fits = true;
+		switch (draw->code) {
+			case DRAW_LINE: {
+				col.c = args[4];
+				if ((fits = pal_index(ctx.pal, col, &idx))) {
+					pal_line(stack[0], args[0], args[1], args[2], args[3], idx);
+				}
+			} break;
+			case DRAW_FILL: {
+				col.c = args[2];
+				if ((fits = pal_index(ctx.pal, col, &idx))) {
+					pal_fill(&ctx, stack[0], args[0], args[1], idx);
+				}
+			} break;
+			case DRAW_ADD_BITMAP: {
+				memmove(stack + 1, stack, sizeof(pal_layer_t *) * depth);
+				stack[0] = take_pal_layer(&ctx);
+				depth++;
+			} break;
+			case DRAW_COMPOSE:
+			case DRAW_CLIP:
+			case DRAW_DISCARD: {
+				if (draw->code != DRAW_DISCARD) {
+					pal_layer_t *out = take_pal_layer(&ctx);
+					fits = pal_merge(ctx.pal, stack[0], stack[1], out, draw->code == DRAW_CLIP);
+					if (!fits) {
+						give_pal_layer(&ctx, out);
+						break;
+					}
+					give_pal_layer(&ctx, stack[1]);
+					stack[1] = out;
+				}
+				give_pal_layer(&ctx, stack[0]);
+				depth--;
+				memmove(stack, stack + 1, sizeof(pal_layer_t *) * depth);
+			} break;
+			default: {
+				run_draw(state, draw);
+			} break;
+		}
+
+		// Out of colors, nothing's been drawn for this one yet so the tiled layers take it from here
+		if (!fits) {
+			trace("Palette is full after %d draws, running the rest on tiled layers\n", i);
+			break;
+		}
+	}
+
+	if (started) {
+		for (int j = 0; j < state->max_bitmaps; j++) {
+			if (j < depth) {
+				pal_to_layer(ctx.pal, stack[j], state->bitmaps[j]);
+			} else {
+				clear_layer(state->bitmaps[j]);
+			}
+		}
+		state->bitmap_size = depth;
+
+		for (; i < dl->len; i++) {
+			run_draw(state, &dl->draws[i]);
+		}
+		state->inst_count = dl->inst_count;
+		state->rna_pos = dl->rna_pos;
+	}
+
+	for (int j = 0; j < depth; j++) {
+		free(stack[j]);
+	}
+	for (int j = 0; j < ctx.spare_count; j++) {
+		free(ctx.spare[j]);
+	}
+	free(stack);
+	free(ctx.spare);
+	free(ctx.seeds);
+	free(ctx.pal);
+	return started;
+}
+
+/*
+ * Early out
+ *
+ * With -T a render gives up as soon as its score can't come in under the
+ * threshold any more. A pass over the draw list first works out which layer
+ * ends up on top and, for every tile of it, the last draw that can change
+ * it. Lines can change the tiles they cross and fills any tile. Compose can
+ * change the tiles of the layer below where anything was drawn on top, and
+ * clip can change any tile of the layer below that isn't clear. Once a tile
+ * is past its last draw its mismatches are there for good, so they count
+ * towards the score straight away.
+ */
+static int score_tile(tile_t *tile, int tile_idx, uint8_t *img, int channels) {
+	int score = 0;
+	int base_x = (tile_idx % TILES_X) * TILE_SIZE;
+	int base_y = (tile_idx / TILES_X) * TILE_SIZE;
+	for (int j = 0; j < TILE_PIXELS; j++) {
+		int img_idx = (((base_y + tile_px_y(j)) * BITMAP_WIDTH) + base_x + tile_px_x(j)) * channels;
+		if (tile->px[j].r != img[img_idx] || tile->px[j].g != img[img_idx + 1] || tile->px[j].b != img[img_idx + 2]) {
+			score++;
+		}
+	}
+	return score;
+}
+
+typedef struct {
+	int depth;
+	int next_id;
+	int *ids;                      // which layer is in each slot of the stack
+	uint8_t (*drawn)[TILE_COUNT];  // per slot, the tiles that might not be clear
+} layer_ids_t;
+
+static void init_layer_ids(layer_ids_t *li, fuun_state_t *state) {
+	li->depth = state->bitmap_size;
+	li->next_id = state->bitmap_size;
+	li->ids = (int *)emalloc(sizeof(int) * state->max_bitmaps);
+	li->drawn = (uint8_t (*)[TILE_COUNT])emalloc(sizeof(*li->drawn) * state->max_bitmaps);
+	for (int i = 0; i < li->depth; i++) {
+		li->ids[i] = i;
+		for (int t = 0; t < TILE_COUNT; t++) {
+			li->drawn[i][t] = state->bitmaps[i]->tiles[t] != &zero_tile;
+		}
+	}
+}
+
+static void free_layer_ids(layer_ids_t *li) {
+	free(li->ids);
+	free(li->drawn);
+}
+
+// Follows one draw on the stack. If the layer with id final is the one it changes, every tile it can change gets i as its last draw
+static void step_layer_ids(layer_ids_t *li, draw_t *draw, int i, int final, int *last_draw) {
+	int *args = draw->args;
+	switch (draw->code) {
+		case DRAW_LINE: {
+			int tx0 = min(args[0], args[2]) / TILE_SIZE;
+			int tx1 = max(args[0], args[2]) / TILE_SIZE;
+			int ty0 = min(args[1], args[3]) / TILE_SIZE;
+			int ty1 = max(args[1], args[3]) / TILE_SIZE;
+			for (int ty = ty0; ty <= ty1; ty++) {
+				for (int tx = tx0; tx <= tx1; tx++) {
+					li->drawn[0][(ty * TILES_X) + tx] = true;
+					if (li->ids[0] == final) {
+						last_draw[(ty * TILES_X) + tx] = i;
+					}
+				}
+			}
+		} break;
+		case DRAW_FILL: {
+			for (int t = 0; t < TILE_COUNT; t++) {
+				li->drawn[0][t] = true;
+				if (li->ids[0] == final) {
+					last_draw[t] = i;
+				}
+			}
+		} break;
+		case DRAW_ADD_BITMAP: {
+			memmove(li->ids + 1, li->ids, sizeof(int) * li->depth);
+			memmove(li->drawn + 1, li->drawn, sizeof(*li->drawn) * li->depth);
+			li->ids[0] = li->next_id++;
+			memset(li->drawn[0], 0, sizeof(*li->drawn));
+			li->depth++;
+		} break;
+		case DRAW_COMPOSE:
+		case DRAW_CLIP:
+		case DRAW_DISCARD: {
+			if (draw->code != DRAW_DISCARD) {
+				bool compose = draw->code == DRAW_COMPOSE;
+				for (int t = 0; t < TILE_COUNT; t++) {
+					bool changes = compose ? li->drawn[0][t] : li->drawn[1][t];
+					if (changes && li->ids[1] == final) {
+						last_draw[t] = i;
+					}
+					li->drawn[1][t] = compose ? (li->drawn[1][t] | li->drawn[0][t]) : (li->drawn[1][t] & li->drawn[0][t]);
+				}
+			}
+			li->depth--;
+			memmove(li->ids, li->ids + 1, sizeof(int) * li->depth);
+			memmove(li->drawn, li->drawn + 1, sizeof(*li->drawn) * li->depth);
+		} break;
+		default: {
+		} break;
+	}
+}
+
+// Runs the draw list like run_draws, but returns false as soon as the score can't get under threshold
+static bool run_draws_bounded(fuun_state_t *state, draw_list_t *dl, uint8_t *img, int channels, int threshold) {
+	// Once to see which layer ends up on top, once more for the last draw on each of its tiles
+	layer_ids_t li;
+	init_layer_ids(&li, state);
+	for (int i = 0; i < dl->len; i++) {
+		step_layer_ids(&li, &dl->draws[i], i, -1, NULL);
+	}
+	int final = li.ids[0];
+	free_layer_ids(&li);
+
+	int *last_draw = (int *)emalloc(sizeof(int) * TILE_COUNT);
+	for (int t = 0; t < TILE_COUNT; t++) {
+		last_draw[t] = -1;
+	}
+	init_layer_ids(&li, state);
+	for (int i = 0; i < dl->len; i++) {
+		step_layer_ids(&li, &dl->draws[i], i, final, last_draw);
+	}
+	free_layer_ids(&li);
+
+	// Tiles by the draw they're done after
+	int *order = (int *)emalloc(sizeof(int) * TILE_COUNT);
+	for (int t = 0; t < TILE_COUNT; t++) {
+		int j = t;
+		for (; j > 0 && last_draw[order[j - 1]] > last_draw[t]; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = t;
+	}
+
+	init_layer_ids(&li, state);
+	int score = 0;
+	int next = 0;
+	bool finished = true;
+	for (int i = -1; i < dl->len; i++) {
+		if (i >= 0) {
+			run_draw(state, &dl->draws[i]);
+			step_layer_ids(&li, &dl->draws[i], i, -1, NULL);
+		}
+
+		// A layer that doesn't exist yet is clear wherever nothing will draw on it
+		layer_t *layer = NULL;
+		for (int slot = 0; slot < li.depth; slot++) {
+			if (li.ids[slot] == final) {
+				layer = state->bitmaps[slot];
+			}
+		}
+		for (; next < TILE_COUNT && last_draw[order[next]] == i; next++) {
+			tile_t *tile = layer ? layer->tiles[order[next]] : &zero_tile;
+			score += score_tile(tile, order[next], img, channels);
+		}
+
+		if (score >= threshold) {
+			trace("Gave up after %d of %d draws, %d of %d tiles in for %d already\n", i + 1, dl->len, next, TILE_COUNT, score);
+			finished = false;
+			break;
+		}
+	}
+
+	free_layer_ids(&li);
+	free(order);
+	free(last_draw);
+
+	if (finished) {
+		state->inst_count = dl->inst_count;
+		state->rna_pos = dl->rna_pos;
+	}
+	return finished;
+}
+
+typedef struct {
+	int stop_at;
+	int checkpoint_every;
+	char *snapshot_dir;
+	char *prefix_cache;
+	int opt_level;
+	bool jit;
+	int parallel;     // workers for -p, 0 to run on this thread
+	bool fill_cache;
+	bool rle;
+	bool palette;
+	bool pipeline;    // decode on another thread while running, see run_pipelined
+	pool_t *fill_pool; // for -g, NULL to do every fill on this thread
+	int preview;       // -V scale, 0 to always render in full
+	int threshold;     // -T, give up once the score can't get under it, 0 to always finish
+	uint8_t *img;      // what -T scores against
+	int channels;
+	snapshot_writer_t *snapshots;
+	frame_writer_t *frames;
+} run_opts_t;
+
+// -F wants a frame after every compose and clip, so those have to stay apart
+static bool can_fuse_merges(run_opts_t *opts) {
+	return opts->opt_level >= 1 && !(opts->frames && opts->frames->frame_on_compose);
+}
+
+static fold_stops_t fold_stops(run_opts_t *opts, bool block_boundaries) {
+	fold_stops_t stops = {0};
+	stops.stop_at = opts->stop_at;
+	stops.block_boundaries = block_boundaries;
+	stops.checkpoint_every = opts->checkpoint_every;
+	stops.frame_every = opts->frames ? opts->frames->frame_every : 0;
+	return stops;
+}
+
+static void optimize_prog(prog_t *prog, fuun_state_t *state, run_opts_t *opts) {
+	if (opts->opt_level >= 2) {
+		int before = prog->len;
+		eliminate_dead_ops(prog, state);
+		trace("Dead drawing elimination: %d -> %d ops\n", before, prog->len);
+	}
+	fold_stops_t stops = fold_stops(opts, opts->prefix_cache != NULL);
+	if (opts->opt_level >= 1) {
+		int before = prog->len;
+		fold_cursor_ops(prog, state->inst_count, &stops);
+		trace("Folded cursor ops: %d -> %d ops\n", before, prog->len);
+	}
+
+	if (can_fuse_merges(opts)) {
+		int before = prog->len;
+		fuse_merges(prog, state->inst_count, &stops);
+		trace("Fused merges: %d -> %d ops\n", before, prog->len);
+	}
+}
+
+// Resolves as much of prog as the run wants into draws and runs those, returns how many ops that was or -1 if it gave up (-T)
+static int run_resolved(fuun_state_t *state, prog_t *prog, run_opts_t *opts) {
+	draw_list_t dl;
+	resolve_draws(&dl, prog, state, opts->stop_at);
+	trace("Resolved %d ops into %d draws\n", dl.op_count, dl.len);
+
+	if (opts->threshold) {
+		bool finished = run_draws_bounded(state, &dl, opts->img, opts->channels, opts->threshold);
+		free(dl.draws);
+		return finished ? dl.op_count : -1;
+	}
+	if (opts->rle) {
+		run_draws_rle(state, &dl);
+		free(dl.draws);
+		return dl.op_count;
+	}
+	if (opts->palette && run_draws_palette(state, &dl)) {
+		free(dl.draws);
+		return dl.op_count;
+	}
+	if (opts->parallel) {
+		run_draws_parallel(state, &dl, opts->parallel);
+		free(dl.draws);
+		return dl.op_count;
+	}
+
+	compiled_t ct = {0};
+	ct.draws = &dl;
+	if (opts->jit && jit_compile(&ct)) {
+		trace("Jitted the draws into %zu bytes of machine code\n", ct.code_size);
+	} else if (opts->jit) {
+		trace("Can't jit here, running the draw list instead\n");
+	}
+
+	run_compiled(state, &ct);
+	free_compiled(&ct);
+	free(dl.draws);
+	return dl.op_count;
+}
+
+// Runs prog from first_op on, returns false if it stopped at -n before the end
+static bool run_ops(fuun_state_t *state, prog_t *prog, int first_op, char *rna_buffer, size_t rna_size, run_opts_t *opts) {
+	// Nothing needs to look at the state between ops, so the whole rest of the program can go in one go
+	if (opts->stop_at < 0 && !opts->prefix_cache && !opts->frames && !opts->checkpoint_every && !verbose) {
+		exec_ops(state, prog->ops + first_op, prog->ops + prog->len);
+		return true;
+	}
+
+	for (int i = first_op; i < prog->len; i++) {
+		if (opts->stop_at >= 0 && state->inst_count >= opts->stop_at) {
+			return false;
+		}
+
+		op_t *op = &prog->ops[i];
+		if (op->code == OP_CURSOR) {
+			trace("(%d) Running: %s (%d, %d) turn %d, %d insts\n", state->inst_count, get_op_name(op), op->dx, op->dy, op->arg, op->count);
+		} else if (get_op_name(op)) {
+			trace("(%d) Running: %s, %d insts\n", state->inst_count, get_op_name(op), op->count);
+		} else {
+			char *rna = rna_buffer + op->rna_start;
+			trace("(%d) Running: %s %.*s\n", state->inst_count, get_inst_name(get_rna_seq(rna)), 7, rna);
+		}
+
+		int prev_inst_count = state->inst_count;
+		exec_op(state, op);
+		state->inst_count += op->count;
+		state->rna_pos = op->rna_end;
+
+		if (opts->prefix_cache) {
+			// Chunks between ops aren't instructions, so the state here is also the state at any block boundary before the next op
+			size_t next_start = ((i + 1) < prog->len) ? prog->ops[i + 1].rna_start : rna_size;
+			size_t boundary = (next_start / PREFIX_BLOCK_SIZE) * PREFIX_BLOCK_SIZE;
+			if (boundary >= state->rna_pos && boundary > 0) {
+				state->rna_pos = boundary;
+				cache_prefix(opts->snapshots, state, rna_buffer, opts->prefix_cache);
+			}
+		}
+
+		// Folding stops at every -f and -k multiple, so these land on them exactly
+		frame_writer_t *fw = opts->frames;
+		if (fw) {
+			bool every = fw->frame_every && (state->inst_count / fw->frame_every) != (prev_inst_count / fw->frame_every);
+			bool merged = fw->frame_on_compose && (op->code == OP_COMPOSE || op->code == OP_CLIP);
+			if (every || merged) {
+				emit_frame(fw, state);
+			}
+		}
+
+		if (opts->checkpoint_every && (state->inst_count / opts->checkpoint_every) != (prev_inst_count / opts->checkpoint_every)) {
+			write_snapshot(opts->snapshots, state, rna_buffer, opts->snapshot_dir);
+		}
+	}
+	return opts->stop_at < 0 || state->inst_count < opts->stop_at;
+}
+
+/*
+ * Decode pipeline
+ *
+ * With -t the trace gets decoded on a thread of its own, DECODE_BLOCK_INSTS
+ * chunks at a time. Each block is folded and fused on that thread too and
+ * handed to the interpreter over a ring, so the interpreter starts on the
+ * first block right away and decoding the rest hides behind running it. With
+ * frames on, the encoder thread makes it three stages. Only the passes that
+ * look at the ops alone can work a block at a time, so it's -O 1 at most,
+ * and cursor runs and merge runs end at block edges.
+ */
+#define DECODE_BLOCK_INSTS 16384
+
+typedef struct {
+	char *rna_buffer;
+	size_t rna_start;
+	size_t rna_size;
+	int inst_start;
+	run_opts_t *opts;
+
+	int decoded;
+	int kept;
+
+	pthread_t thread;
+	ring_t ring;
+} decoder_t;
+
+static void *decoder_main(void *arg) {
+	decoder_t *dec = (decoder_t *)arg;
+	run_opts_t *opts = dec->opts;
+
+	int inst_count = dec->inst_start;
+	size_t block_size = (size_t)DECODE_BLOCK_INSTS * 7;
+	for (size_t pos = dec->rna_start; (pos + 7) <= dec->rna_size; pos += block_size) {
+		prog_t *prog = (prog_t *)ecalloc(1, sizeof(prog_t));
+		decode_rna(prog, dec->rna_buffer, pos, min(pos + block_size, dec->rna_size));
+		if (prog->len == 0) {
+			free(prog);
+			continue;
+		}
+
+		int block_start = inst_count;
+		inst_count += prog->len;
+		dec->decoded += prog->len;
+
+		fold_stops_t stops = fold_stops(opts, false);
+		if (opts->opt_level >= 1) {
+			fold_cursor_ops(prog, block_start, &stops);
+		}
+		if (can_fuse_merges(opts)) {
+			fuse_merges(prog, block_start, &stops);
+		}
+		dec->kept += prog->len;
+
+		ring_push(&dec->ring, prog);
+
+		// Nobody will run past -n, so there's no point decoding past it
+		if (opts->stop_at >= 0 && inst_count >= opts->stop_at) {
+			break;
+		}
+	}
+
+	ring_close(&dec->ring);
+	return NULL;
+}
+
+static bool run_pipelined(fuun_state_t *state, char *rna_buffer, size_t rna_size, run_opts_t *opts) {
+	decoder_t dec = {0};
+	dec.rna_buffer = rna_buffer;
+	dec.rna_start = state->rna_pos;
+	dec.rna_size = rna_size;
+	dec.inst_start = state->inst_count;
+	dec.opts = opts;
+	ring_init(&dec.ring);
+
+	if (pthread_create(&dec.thread, NULL, decoder_main, &dec) != 0) {
+		panic("Failed to start the decoder thread!\n");
+	}
+
+	bool finished = true;
+	prog_t *prog;
+	while ((prog = (prog_t *)ring_pop(&dec.ring)) != NULL) {
+		if (finished) {
+			finished = run_ops(state, prog, 0, rna_buffer, rna_size, opts);
+		}
+		free(prog->ops);
+		free(prog);
+	}
+
+	pthread_join(dec.thread, NULL);
+	trace("Decoded %d ops on the side, %d after folding and fusing\n", dec.decoded, dec.kept);
+	return finished;
+}
+
+// Returns the top bitmap, or NULL if the render gave up on beating opts->threshold
+static layer_t *process_rna(fuun_state_t *state, char *rna_buffer, size_t rna_size, run_opts_t *opts) {
+	if (opts->fill_cache && state->fill_cache == NULL) {
+		state->fill_cache = new_fill_cache();
+	}
+	state->fill_pool = opts->fill_pool;
+
+	if (opts->pipeline) {
+		run_pipelined(state, rna_buffer, rna_size, opts);
+	} else {
+		prog_t prog = {0};
+		decode_rna(&prog, rna_buffer, state->rna_pos, rna_size);
+		optimize_prog(&prog, state, opts);
+
+		int first_op = 0;
+		if (opts->opt_level >= 3 || opts->jit || opts->parallel || opts->rle || opts->palette || opts->threshold) {
+			first_op = run_resolved(state, &prog, opts);
+		}
+		if (first_op < 0) {
+			free(prog.ops);
+			return NULL;
+		}
+
+		run_ops(state, &prog, first_op, rna_buffer, rna_size, opts);
+		free(prog.ops);
+	}
+
+	// Trailing chunks that aren't instructions still count as read
+	if (opts->stop_at < 0 || state->inst_count < opts->stop_at) {
+		state->rna_pos = max(state->rna_pos, rna_size - (rna_size % 7));
+	}
+
+	if (opts->frames) {
+		emit_frame(opts->frames, state);
+	}
+
+	return state->bitmaps[0];
+}
+
+// Resolves the trace as it runs from a fresh state and writes it out as C and/or as a draw list
+static void write_trace(char *c_filename, char *draws_filename, char *rna_filename, char *rna_buffer, size_t rna_size, run_opts_t *opts) {
+	fuun_state_t state;
+	init_state(&state);
+
+	prog_t prog = {0};
+	decode_rna(&prog, rna_buffer, 0, rna_size);
+	optimize_prog(&prog, &state, opts);
+
+	draw_list_t dl;
+	resolve_draws(&dl, &prog, &state, opts->stop_at);
+	if (c_filename) {
+		write_compiled_c(&dl, c_filename, rna_filename);
+		printf("Wrote %d kernel calls for %d instructions to %s\n", dl.len, dl.inst_count, c_filename);
+	}
+	if (draws_filename) {
+		write_draw_list(&dl, draws_filename, rna_filename);
+		printf("Wrote %d draws for %d instructions to %s\n", dl.len, dl.inst_count, draws_filename);
+	}
+
+	free(dl.draws);
+	free(prog.ops);
+	free_state(&state);
+}
+
+static char *dir_names[] = { "N", "E", "S", "W" };
+static void print_state(fuun_state_t *state) {
+	printf("State after %d instructions (rna offset %zu):\n", state->inst_count, state->rna_pos);
+	printf("  pos: (%d, %d) mark: (%d, %d) dir: %s\n", state->pos_x, state->pos_y, state->mark_x, state->mark_y, dir_names[state->dir]);
+	printf("  bucket: %d colors, current (%s)\n", state->bucket_len, print_color(get_cur_col(state)));
+	printf("  bitmaps: %d\n", state->bitmap_size);
+}
+
+// Number of pixels that don't match the target. Alpha is ignored, same as when the image is shown
+static int score_layer(layer_t *layer, uint8_t *img, int channels) {
+	int score = 0;
+	for (int t = 0; t < TILE_COUNT; t++) {
+		score += score_tile(layer->tiles[t], t, img, channels);
+	}
+	return score;
+}
+
+/*
+ * Preview scoring
+ *
+ * With -V the draw list renders onto bitmaps of 2x2 or 4x4 blocks to score a
+ * trace for a fraction of the work. A block is all one color until something
+ * draws over part of it, which only lines do, and from then on it has its own
+ * pixels. A fill paints a flat block in one go and carries on to the blocks
+ * around it, and compose and clip do a pair of flat blocks with one pixel op,
+ * so the big flat areas cost a quarter or a sixteenth of what they would and
+ * the score still comes out exact.
+ */
+typedef struct {
+	color_t col;   // every pixel's color, unless the block has its own
+	color_t *px;
+} block_t;
+
+typedef struct {
+	int scale;
+	int side;      // blocks across and down
+	int depth;
+	block_t **stack;
+
+	// Pixel buffers of blocks that went flat again, for the next block that needs one
+	color_t **spare;
+	int spare_len;
+	int spare_cap;
+
+	int *seeds;
+	int seed_len;
+	int seed_cap;
+
+	int splits;
+} preview_t;
+
+#define block_at(pv, layer, x, y) (&(layer)[(((y) / (pv)->scale) * (pv)->side) + ((x) / (pv)->scale)])
+#define block_px_index(pv, x, y)  ((((y) % (pv)->scale) * (pv)->scale) + ((x) % (pv)->scale))
+
+static void set_block_flat(preview_t *pv, block_t *block, color_t col) {
+	if (block->px) {
+		if (pv->spare_len == pv->spare_cap) {
+			pv->spare_cap = max(pv->spare_cap * 2, 256);
+			pv->spare = (color_t **)erealloc(pv->spare, sizeof(color_t *) * pv->spare_cap);
+		}
+		pv->spare[pv->spare_len++] = block->px;
+		block->px = NULL;
+	}
+	block->col = col;
+}
+
+static void split_block(preview_t *pv, block_t *block) {
+	if (block->px) {
+		return;
+	}
+
+	int pixels = pv->scale * pv->scale;
+	block->px = pv->spare_len ? pv->spare[--pv->spare_len] : (color_t *)emalloc(sizeof(color_t) * pixels);
+	for (int i = 0; i < pixels; i++) {
+		block->px[i] = block->col;
+	}
+	pv->splits++;
+}
+
+static block_t *new_preview_layer(preview_t *pv) {
+	return (block_t *)ecalloc(pv->side * pv->side, sizeof(block_t));
+}
+
+static void free_preview_layer(preview_t *pv, block_t *layer) {
+	color_t clear = {0};
+	for (int i = 0; i < (pv->side * pv->side); i++) {
+		set_block_flat(pv, &layer[i], clear);
+	}
+	free(layer);
+}
+
+static void preview_set(preview_t *pv, block_t *layer, int x, int y, color_t col) {
+	block_t *block = block_at(pv, layer, x, y);
+	if (block->px == NULL && block->col.c == col.c) {
+		return;
+	}
+	split_block(pv, block);
+	block->px[block_px_index(pv, x, y)] = col;
+}
+
+static void preview_line(preview_t *pv, block_t *layer, int x0, int y0, int x1, int y1, color_t col) {
+	int dx = x1 - x0;
+	int dy = y1 - y0;
+	int d = max(abs(dx), abs(dy));
+
+	int c = ((dx * dy) <= 0) ? 1 : 0;
+
+	int offset = (d - c) / 2;
+	int x = x0 * d + offset;
+	int y = y0 * d + offset;
+
+	for (int j = 0; j < d; j++) {
+		preview_set(pv, layer, x / d, y / d, col);
+		x += dx;
+		y += dy;
+	}
+
+	preview_set(pv, layer, x1, y1, col);
+}
+
+static void preview_push(preview_t *pv, int x, int y) {
+	if (pv->seed_len == pv->seed_cap) {
+		pv->seed_cap = max(pv->seed_cap * 2, 4096);
+		pv->seeds = (int *)erealloc(pv->seeds, sizeof(int) * pv->seed_cap);
+	}
+	pv->seeds[pv->seed_len++] = (y * BITMAP_WIDTH) + x;
+}
+
+// Pushes the pixels just past one edge of a block, starting at x, y and going along dx, dy. A flat block there only needs one
+static void preview_push_edge(preview_t *pv, block_t *layer, int x, int y, int dx, int dy) {
+	if (x < 0 || y < 0 || x >= BITMAP_WIDTH || y >= BITMAP_HEIGHT) {
+		return;
+	}
+
+	if (block_at(pv, layer, x, y)->px == NULL) {
+		preview_push(pv, x, y);
+		return;
+	}
+	for (int i = 0; i < pv->scale; i++) {
+		preview_push(pv, x + (i * dx), y + (i * dy));
+	}
+}
+
+// Same region as fill_bitmap. Fills never split a block, so a flat block is either all in the region or not at all
+static void preview_fill(preview_t *pv, block_t *layer, int x, int y, color_t col) {
+	pv->seed_len = 0;
+	preview_push(pv, x, y);
+
+	while (pv->seed_len > 0) {
+		int pos = pv->seeds[--pv->seed_len];
+		x = pos % BITMAP_WIDTH;
+		y = pos / BITMAP_WIDTH;
+
+		block_t *block = block_at(pv, layer, x, y);
+		if (block->px == NULL) {
+			if (block->col.c == col.c) {
+				continue;
+			}
+			block->col = col;
+
+			int base_x = x - (x % pv->scale);
+			int base_y = y - (y % pv->scale);
+			preview_push_edge(pv, layer, base_x - 1, base_y, 0, 1);
+			preview_push_edge(pv, layer, base_x + pv->scale, base_y, 0, 1);
+			preview_push_edge(pv, layer, base_x, base_y - 1, 1, 0);
+			preview_push_edge(pv, layer, base_x, base_y + pv->scale, 1, 0);
+			continue;
+		}
+
+		color_t *px = &block->px[block_px_index(pv, x, y)];
+		if (px->c == col.c) {
+			continue;
+		}
+		*px = col;
+
+		if (x > 0) {
+			preview_push(pv, x - 1, y);
+		}
+		if (x < (BITMAP_WIDTH - 1)) {
+			preview_push(pv, x + 1, y);
+		}
+		if (y > 0) {
+			preview_push(pv, x, y - 1);
+		}
+		if (y < (BITMAP_HEIGHT - 1)) {
+			preview_push(pv, x, y + 1);
+		}
+	}
+}
+
+static void preview_merge(preview_t *pv, block_t *top, block_t *below, bool clip) {
+	int pixels = pv->scale * pv->scale;
+	color_t clear = {0};
+
+	for (int i = 0; i < (pv->side * pv->side); i++) {
+		block_t *t = &top[i];
+		block_t *b = &below[i];
+		if (t->px == NULL && b->px == NULL) {
+			b->col = clip ? clip_px(t->col, b->col) : compose_px(t->col, b->col);
+			continue;
+		}
+
+		// A flat top that's clear or opaque decides the whole block, same as compose_layers and clip_layers for tiles
+		if (t->px == NULL && t->col.c == 0) {
+			if (clip) {
+				set_block_flat(pv, b, clear);
+			}
+			continue;
+		}
+		if (t->px == NULL && t->col.a == 255) {
+			if (!clip) {
+				set_block_flat(pv, b, t->col);
+			}
+			continue;
+		}
+		if (clip && b->px == NULL && b->col.c == 0) {
+			continue;
+		}
+
+		split_block(pv, b);
+		bool flat = true;
+		for (int j = 0; j < pixels; j++) {
+			color_t top_px = t->px ? t->px[j] : t->col;
+			b->px[j] = clip ? clip_px(top_px, b->px[j]) : compose_px(top_px, b->px[j]);
+			flat = flat && (b->px[j].c == b->px[0].c);
+		}
+		if (flat) {
+			set_block_flat(pv, b, b->px[0]);
+		}
+	}
+}
+
+static void run_preview(preview_t *pv, draw_list_t *dl) {
+	pv->depth = 1;
+	pv->stack[0] = new_preview_layer(pv);
+
+	for (int i = 0; i < dl->len; i++) {
+		draw_t *draw = &dl->draws[i];
+		int *args = draw->args;
+		color_t col;
+		switch (draw->code) {
+			case DRAW_LINE: {
+				col.c = args[4];
+				preview_line(pv, pv->stack[0], args[0], args[1], args[2], args[3], col);
+			} break;
+			case DRAW_FILL: {
+				col.c = args[2];
+				preview_fill(pv, pv->stack[0], args[0], args[1], col);
+			} break;
+			case DRAW_ADD_BITMAP: {
+				memmove(pv->stack + 1, pv->stack, sizeof(block_t *) * pv->depth);
+				pv->stack[0] = new_preview_layer(pv);
+				pv->depth++;
+			} break;
+			case DRAW_COMPOSE:
+			case DRAW_CLIP:
+			case DRAW_DISCARD: {
+				if (draw->code != DRAW_DISCARD) {
+					preview_merge(pv, pv->stack[0], pv->stack[1], draw->code == DRAW_CLIP);
+				}
+				free_preview_layer(pv, pv->stack[0]);
+				pv->depth--;
+				memmove(pv->stack, pv->stack + 1, sizeof(block_t *) * pv->depth);
+			} break;
+			default: {
+				// The cursor and bucket don't show up in the image
+			} break;
+		}
+	}
+}
+
+// Scores the trace run from a fresh state the way score_layer would score the full render
+static int preview_score(fuun_state_t *state, char *rna_buffer, size_t rna_size, int scale, uint8_t *img, int channels, int *inst_count) {
+	// Only the final image matters, so everything that doesn't reach it can go
+	run_opts_t opts = {0};
+	opts.stop_at = -1;
+	opts.opt_level = 2;
+
+	prog_t prog = {0};
+	decode_rna(&prog, rna_buffer, state->rna_pos, rna_size);
+	optimize_prog(&prog, state, &opts);
+
+	draw_list_t dl;
+	resolve_draws(&dl, &prog, state, -1);
+	*inst_count = dl.inst_count;
+
+	preview_t pv = {0};
+	pv.scale = scale;
+	pv.side = BITMAP_WIDTH / scale;
+	pv.stack = (block_t **)emalloc(sizeof(block_t *) * state->max_bitmaps);
+	run_preview(&pv, &dl);
+	trace("Previewed %d draws on %dx%d blocks, %d blocks split\n", dl.len, scale, scale, pv.splits);
+
+	int score = 0;
+	for (int i = 0; i < (pv.side * pv.side); i++) {
+		block_t *block = &pv.stack[0][i];
+		int base_x = (i % pv.side) * scale;
+		int base_y = (i / pv.side) * scale;
+		for (int j = 0; j < (scale * scale); j++) {
+			color_t px = block->px ? block->px[j] : block->col;
+			int img_idx = (((base_y + (j / scale)) * BITMAP_WIDTH) + base_x + (j % scale)) * channels;
+			if (px.r != img[img_idx] || px.g != img[img_idx + 1] || px.b != img[img_idx + 2]) {
+				score++;
+			}
+		}
+	}
+
+	for (int i = 0; i < pv.depth; i++) {
+		free_preview_layer(&pv, pv.stack[i]);
+	}
+	for (int i = 0; i < pv.spare_len; i++) {
+		free(pv.spare[i]);
+	}
+	free(pv.spare);
+	free(pv.seeds);
+	free(pv.stack);
+	free(dl.draws);
+	free(prog.ops);
+	return score;
+}
+
+/*
+ * Batch rendering
+ *
+ * Renders a whole list of traces on the thread pool. Each pool slot keeps its
+ * own renderer state around and resets it between jobs, and every job writes
+ * its image and appends its score line as soon as it's done. With -V every
+ * trace gets scored on a preview first, and only the ones that beat the best
+ * so far get rendered in full and written out. With -T a render gives up as
+ * soon as it can't beat the best so far, and its line says >= whatever that
+ * was.
+ */
+typedef struct {
+	char *out_dir;
+	int scores_fd;
+
+	uint8_t *img;
+	int channels;
+	run_opts_t opts;
+
+	fuun_state_t *contexts;
+	bool *context_ready;
+
+	int best_score;
+	char *best_path;
+	pthread_mutex_t best_lock;
+
+	int rejected;
+} batch_t;
+
+typedef struct {
+	batch_t *batch;
+	char *path;
+} batch_job_t;
+
+static char *base_name(char *path) {
+	char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+// One write on an O_APPEND fd, so lines from different workers never interleave
+static void write_score_line(batch_t *batch, char *path, char *score, int inst_count) {
+	char line[PATH_MAX + 64];
+	int line_len = (inst_count >= 0) ? snprintf(line, sizeof(line), "%s\t%s\t%d\n", path, score, inst_count) : snprintf(line, sizeof(line), "%s\t%s\t-\n", path, score);
+	if (write(batch->scores_fd, line, line_len) != line_len) {
+		panic("Failed to write score for %s\n", path);
+	}
+}
+
+static void render_batch_job(void *arg, int slot) {
+	batch_job_t *job = (batch_job_t *)arg;
+	batch_t *batch = job->batch;
+
+	fuun_state_t *state = &batch->contexts[slot];
+	if (!batch->context_ready[slot]) {
+		init_state(state);
+		batch->context_ready[slot] = true;
+	} else {
+		reset_state(state);
+	}
+
+	size_t rna_size;
+	char *rna_buffer = read_file(job->path, &rna_size);
+
+	if (batch->opts.preview) {
+		int inst_count;
+		int score = preview_score(state, rna_buffer, rna_size, batch->opts.preview, batch->img, batch->channels, &inst_count);
+
+		pthread_mutex_lock(&batch->best_lock);
+		bool hopeless = batch->best_path != NULL && score >= batch->best_score;
+		pthread_mutex_unlock(&batch->best_lock);
+
+		if (hopeless) {
+			char score_str[16];
+			snprintf(score_str, sizeof(score_str), "%d", score);
+			write_score_line(batch, job->path, score_str, inst_count);
+
+			__atomic_fetch_add(&batch->rejected, 1, __ATOMIC_RELAXED);
+			free(rna_buffer);
+			free(job);
+			return;
+		}
+	}
+
+	// With -T nothing that can't beat the best so far is worth finishing
+	run_opts_t opts = batch->opts;
+	if (opts.threshold) {
+		pthread_mutex_lock(&batch->best_lock);
+		if (batch->best_path != NULL) {
+			opts.threshold = max(min(opts.threshold, batch->best_score), 1);
+		}
+		pthread_mutex_unlock(&batch->best_lock);
+	}
+
+	layer_t *top = process_rna(state, rna_buffer, rna_size, &opts);
+	if (top == NULL) {
+		char score_str[16];
+		snprintf(score_str, sizeof(score_str), ">=%d", opts.threshold);
+		write_score_line(batch, job->path, score_str, -1);
+
+		__atomic_fetch_add(&batch->rejected, 1, __ATOMIC_RELAXED);
+		free(rna_buffer);
+		free(job);
+		return;
+	}
+	int score = score_layer(top, batch->img, batch->channels);
+
+	char out_filename[PATH_MAX];
+	char *name = base_name(job->path);
+	char *ext = strrchr(name, '.');
+	int name_len = ext ? (int)(ext - name) : (int)strlen(name);
+	snprintf(out_filename, sizeof(out_filename), "%s/%.*s.png", batch->out_dir, name_len, name);
+
+	color_t *rgba = (color_t *)emalloc(sizeof(color_t) * BITMAP_WIDTH * BITMAP_HEIGHT);
+	layer_to_rgba(top, rgba);
+	if (!stbi_write_png(out_filename, BITMAP_WIDTH, BITMAP_HEIGHT, 4, rgba, BITMAP_WIDTH * 4)) {
+		panic("Failed to write %s\n", out_filename);
+	}
+
+	char score_str[16];
+	snprintf(score_str, sizeof(score_str), "%d", score);
+	write_score_line(batch, job->path, score_str, state->inst_count);
+
+	pthread_mutex_lock(&batch->best_lock);
+	if (batch->best_path == NULL || score < batch->best_score) {
+		batch->best_score = score;
+		batch->best_path = job->path;
+	}
+	pthread_mutex_unlock(&batch->best_lock);
+
+	free(rgba);
+	free(rna_buffer);
+	free(job);
+}
+
+static int cmp_str(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Batch input is either a directory of .rna files or a file listing one trace path per line
+static char **list_batch_inputs(char *input, int *input_count) {
+	int max_inputs = 64;
+	int count = 0;
+	char **inputs = (char **)emalloc(sizeof(char *) * max_inputs);
+
+	struct stat st;
+	if (stat(input, &st) == -1) {
+		panic("Failed to stat batch input: %s\n", input);
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(input);
+		if (dir == NULL) {
+			panic("Failed to open batch dir: %s\n", input);
+		}
+
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			size_t len = strlen(ent->d_name);
+			if (len < 4 || strcmp(ent->d_name + len - 4, ".rna") != 0) {
+				continue;
+			}
+
+			if (count == max_inputs) {
+				max_inputs *= 2;
+				inputs = (char **)erealloc(inputs, sizeof(char *) * max_inputs);
+			}
+
+			size_t path_size = strlen(input) + len + 2;
+			inputs[count] = (char *)emalloc(path_size);
+			snprintf(inputs[count], path_size, "%s/%s", input, ent->d_name);
+			count++;
+		}
+		closedir(dir);
+
+		qsort(inputs, count, sizeof(char *), cmp_str);
+	} else {
+		size_t list_size;
+		char *list = read_file(input, &list_size);
+		list[list_size] = '\0';
+
+		for (char *line = strtok(list, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+			if (*line == '\0') {
+				continue;
+			}
+
+			if (count == max_inputs) {
+				max_inputs *= 2;
+				inputs = (char **)erealloc(inputs, sizeof(char *) * max_inputs);
+			}
+			inputs[count++] = line;
+		}
+	}
+
+	*input_count = count;
+	return inputs;
 }
 
+static void run_batch(char *input, char *out_dir, int worker_count, run_opts_t *opts, uint8_t *img, int channels) {
+	int input_count;
+	char **inputs = list_batch_inputs(input, &input_count);
 
-#define get_rna_seq(rna) (((uint64_t)((rna)[6])) << 48 | ((uint64_t)((rna)[5])) << 40 | ((uint64_t)((rna)[4])) << 32 | ((uint64_t)((rna)[3])) << 24 | ((uint64_t)((rna)[2])) << 16 | ((uint64_t)((rna)[1])) << 8 | ((uint64_t)((rna)[0])))
-
-#define max(x, y) (((x) > (y)) ? (x) : (y))
+	make_dir(out_dir);
 
-typedef enum {
-	ADD_COLOR_BLACK       = get_rna_seq("PIPIIIC"),
-	ADD_COLOR_RED         = get_rna_seq("PIPIIIP"),
-	ADD_COLOR_GREEN       = get_rna_seq("PIPIICC"),
-	ADD_COLOR_YELLOW      = get_rna_seq("PIPIICF"),
-	ADD_COLOR_BLUE        = get_rna_seq("PIPIICP"),
-	ADD_COLOR_MAGENTA     = get_rna_seq("PIPIIFC"),
-	ADD_COLOR_CYAN        = get_rna_seq("PIPIIFF"),
-	ADD_COLOR_WHITE       = get_rna_seq("PIPIIPC"),
-	ADD_ALPHA_TRANSPARENT = get_rna_seq("PIPIIPF"),
-	ADD_ALPHA_OPAQUE      = get_rna_seq("PIPIIPP"),
-	CLEAR_BUCKET          = get_rna_seq("PIIPICP"),
-	MOVE                  = get_rna_seq("PIIIIIP"),
-	TURN_CCLOCKWISE       = get_rna_seq("PCCCCCP"),
-	TURN_CLOCKWISE        = get_rna_seq("PFFFFFP"),
-	MARK        		  = get_rna_seq("PCCIFFP"),
-	LINE        		  = get_rna_seq("PFFICCP"),
-	FILL        		  = get_rna_seq("PIIPIIP"),
-	ADD_BITMAP       	  = get_rna_seq("PCCPFFP"),
-	COMPOSE       	      = get_rna_seq("PFFPCCP"),
-	CLIP       	      	  = get_rna_seq("PFFICCF"),
-} inst_t;
+	char scores_filename[PATH_MAX];
+	snprintf(scores_filename, sizeof(scores_filename), "%s/scores.txt", out_dir);
 
-static char *get_inst_name(inst_t inst) {
-	switch (inst) {
-		case ADD_COLOR_BLACK:       return "Add Color: Black";
-		case ADD_COLOR_RED:         return "Add Color: Red";
-		case ADD_COLOR_GREEN:       return "Add Color: Green";
-		case ADD_COLOR_YELLOW:      return "Add Color: Yellow";
-		case ADD_COLOR_BLUE:        return "Add Color: Blue";
-		case ADD_COLOR_MAGENTA:     return "Add Color: Magenta";
-		case ADD_COLOR_CYAN:        return "Add Color: Cyan";
-		case ADD_COLOR_WHITE:       return "Add Color: White";
-		case ADD_ALPHA_TRANSPARENT: return "Add Alpha: Transparent";
-		case ADD_ALPHA_OPAQUE:      return "Add Alpha: Opaque";
-		case CLEAR_BUCKET:          return "Clear Bucket";
-		case MOVE:                  return "Move";
-		case TURN_CCLOCKWISE:       return "Turn Counter-Clockwise";
-		case TURN_CLOCKWISE:        return "Turn Clockwise";
-		case MARK:                  return "Set Mark";
-		case LINE:                  return "Draw Line";
-		case FILL:                  return "Fill";
-		case ADD_BITMAP:            return "Add Bitmap";
-		case COMPOSE:               return "Compose";
-		case CLIP:                  return "Clip";
-		default:                    return NULL;
+	batch_t batch = {0};
+	batch.out_dir = out_dir;
+	batch.img = img;
+	batch.channels = channels;
+	batch.opts.stop_at = -1;
+	batch.opts.opt_level = opts->opt_level;
+	batch.opts.jit = opts->jit;
+	batch.opts.fill_cache = opts->fill_cache;
+	batch.opts.rle = opts->rle;
+	batch.opts.palette = opts->palette;
+	batch.opts.pipeline = opts->pipeline;
+	batch.opts.preview = opts->preview;
+	batch.opts.threshold = opts->threshold;
+	batch.opts.img = img;
+	batch.opts.channels = channels;
+	batch.scores_fd = open(scores_filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (batch.scores_fd == -1) {
+		panic("Failed to open %s\n", scores_filename);
 	}
-}
+	pthread_mutex_init(&batch.best_lock, NULL);
 
-typedef enum {
-	DIR_N,
-	DIR_S,
-	DIR_W,
-	DIR_E,
-} dir_t;
+	pool_t *pool = pool_create(worker_count);
 
-typedef enum {
-	COLOR_RGB,
-	COLOR_ALPHA
-} color_kind_t;
+	// One extra context for the calling thread, it runs jobs too while it waits
+	batch.contexts = (fuun_state_t *)ecalloc(pool->worker_count + 1, sizeof(fuun_state_t));
+	batch.context_ready = (bool *)ecalloc(pool->worker_count + 1, sizeof(bool));
 
-typedef struct {
-	union {
-		struct {
-			uint8_t r;
-			uint8_t g;
-			uint8_t b;
-			uint8_t a;
-		};
-		uint32_t c;
-	};
-} color_t;
+	printf("Rendering %d traces on %d workers\n", input_count, pool->worker_count);
 
-typedef struct {
-	color_t c;
-	color_kind_t type;
-} color_wrap_t;
+	task_group_t group = {0};
+	for (int i = 0; i < input_count; i++) {
+		batch_job_t *job = (batch_job_t *)emalloc(sizeof(batch_job_t));
+		job->batch = &batch;
+		job->path = inputs[i];
+		pool_submit(pool, &group, render_batch_job, job);
+	}
+	pool_wait(pool, &group);
+	int context_count = pool->worker_count + 1;
+	pool_destroy(pool);
 
-typedef struct {
-	int x;
-	int y;
-} pos_t;
+	for (int i = 0; i < context_count; i++) {
+		if (batch.context_ready[i]) {
+			free_state(&batch.contexts[i]);
+		}
+	}
+	free(batch.contexts);
+	free(batch.context_ready);
+	close(batch.scores_fd);
+
+	printf("Wrote %d images and %s\n", input_count - batch.rejected, scores_filename);
+	if (batch.rejected) {
+		printf("Skipped %d traces that didn't beat the best so far\n", batch.rejected);
+	}
+	if (batch.best_path) {
+		printf("Best: %s (score %d)\n", batch.best_path, batch.best_score);
+	}
+}
+
+/*
+ * Reference renderer
+ *
+ * The interpreter from before any of the fast paths went in, copied over line
+ * for line, so -x checks every fast path against the code it replaced and not
+ * against a rewrite of it. Leave it alone. Its names are moved out of the way
+ * by the macros around it and its printfs go through trace(), which -x turns
+ * off. The only lines that differ are the ones marked "ref:", which hand the
+ * whole state back instead of only the top bitmap. It shares the instruction
+ * codes, color_t, color_wrap_t, pos_t and the dir_t names with everything else,
+ * since those are the trace format rather than rendering.
+ */
+#define fuun_state_t       ref_fuun_state_t
+#define get_cur_col        ref_get_cur_col
+#define add_color          ref_add_color
+#define color_buffer       ref_color_buffer
+#define print_color        ref_print_color
+#define process_rna        ref_process_rna
+#define color_black        ref_color_black
+#define color_white        ref_color_white
+#define color_red          ref_color_red
+#define color_green        ref_color_green
+#define color_blue         ref_color_blue
+#define color_yellow       ref_color_yellow
+#define color_magenta      ref_color_magenta
+#define color_cyan         ref_color_cyan
+#define alpha_opaque       ref_alpha_opaque
+#define alpha_transparent  ref_alpha_transparent
+#define printf(...)        trace(__VA_ARGS__)
+
+// It's kept as it was, warnings and all
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-braces"
+#pragma GCC diagnostic ignored "-Wsign-compare"
 
 #define BITMAP_WIDTH 600
 #define BITMAP_HEIGHT 600
@@ -263,7 +5515,7 @@ static char *print_color(color_t col) {
 	return color_buffer;
 }
 
-static color_t *process_rna(char *rna_buffer, size_t rna_size) {
+static color_t *process_rna(char *rna_buffer, size_t rna_size, fuun_state_t *out, int *out_inst_count) { // ref: hands its state back
 	char *rna = rna_buffer;
 
 	fuun_state_t state = {0};
@@ -564,17 +5816,538 @@ static color_t *process_rna(char *rna_buffer, size_t rna_size) {
 	}
 
 	printf("inst count: %d\n", inst_count);
+	*out = state; // ref: hands its state back
+	*out_inst_count = inst_count; // ref: hands its state back
 	return state.bitmaps[0];
 }
 
+#pragma GCC diagnostic pop
+
+#undef fuun_state_t
+#undef get_cur_col
+#undef add_color
+#undef color_buffer
+#undef print_color
+#undef process_rna
+#undef color_black
+#undef color_white
+#undef color_red
+#undef color_green
+#undef color_blue
+#undef color_yellow
+#undef color_magenta
+#undef color_cyan
+#undef alpha_opaque
+#undef alpha_transparent
+#undef printf
+
+typedef ref_fuun_state_t ref_state_t;
+
+static void free_ref_state(ref_state_t *ref) {
+	for (int i = 0; i < ref->max_bitmaps; i++) {
+		free(ref->bitmaps[i]);
+	}
+	free(ref->bitmaps);
+	free(ref->bucket);
+	free(ref->fill_stack);
+}
+
+// Where the nth instruction (from 0) starts in the RNA
+static size_t inst_offset(char *rna_buffer, size_t rna_size, int n) {
+	size_t i = 0;
+	for (; (i + 7) <= rna_size; i += 7) {
+		uint8_t arg;
+		if (decode_inst(get_rna_seq(rna_buffer + i), &arg) != OP_NONE && n-- == 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+// Runs the reference over the first stop_at instructions, or all of them if stop_at is -1, by cutting the RNA short there
+static void ref_run(ref_state_t *ref, int *inst_count, char *rna_buffer, size_t rna_size, int stop_at) {
+	size_t size = (stop_at < 0) ? (rna_size - (rna_size % 7)) : inst_offset(rna_buffer, rna_size, stop_at);
+	ref_process_rna(rna_buffer, size, ref, inst_count);
+}
+
+/*
+ * Differential testing
+ *
+ * With -x, every trace on the command line plus some number of fuzzed ones
+ * runs through the reference and through the renderer set up by the other
+ * flags. If the final images differ, a bisection over the instruction count
+ * narrows it down to an instruction that takes the two from the same state to
+ * different ones, and that instruction and the first differing thing about
+ * the states gets reported. Bisection only ever compares whole states, so
+ * with -O 2 it uses -O 1, which can make a difference that only dead drawing
+ * elimination causes show up as final image only.
+ */
+static const char *fuzz_insts[] = {
+	"PIPIIIC", "PIPIIIP", "PIPIICC", "PIPIICF", "PIPIICP",
+	"PIPIIFC", "PIPIIFF", "PIPIIPC", "PIPIIPF", "PIPIIPP",
+	"PIIPICP", "PIIIIIP", "PCCCCCP", "PFFFFFP", "PCCIFFP",
+	"PFFICCP", "PIIPIIP", "PCCPFFP", "PFFPCCP", "PFFICCF",
+};
+
+typedef enum {
+	FUZZ_COLOR,
+	FUZZ_CLEAR_BUCKET,
+	FUZZ_MOVES,
+	FUZZ_TURN,
+	FUZZ_MARK,
+	FUZZ_LINE,
+	FUZZ_FILL,
+	FUZZ_ADD_BITMAP,
+	FUZZ_COMPOSE,
+	FUZZ_CLIP,
+	FUZZ_JUNK,
+	FUZZ_KIND_COUNT,
+} fuzz_kind_t;
+
+// Out of 100, roughly what real traces look like but with a lot more bitmap juggling
+static const int fuzz_weights[FUZZ_KIND_COUNT] = { 14, 9, 22, 12, 9, 11, 8, 6, 5, 3, 1 };
+
+static uint64_t fuzz_rand(uint64_t *rng) {
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 7;
+	*rng ^= *rng << 17;
+	return *rng;
+}
+
+static void push_chunk(char **buffer, size_t *size, size_t *cap, const char *chunk) {
+	if ((*size + 7) >= *cap) {
+		*cap = max(*cap * 2, 4096);
+		*buffer = (char *)erealloc(*buffer, *cap);
+	}
+	memcpy(*buffer + *size, chunk, 7);
+	*size += 7;
+}
+
+// A random but valid instruction stream, with the odd chunk that isn't an instruction mixed in
+static char *fuzz_rna(uint64_t seed, size_t *rna_size) {
+	uint64_t rng = seed * 0x9e3779b97f4a7c15ull + 1;
+	char *buffer = NULL;
+	size_t size = 0;
+	size_t cap = 0;
+
+	int events = 200 + (fuzz_rand(&rng) % 2000);
+	for (int i = 0; i < events; i++) {
+		int roll = fuzz_rand(&rng) % 100;
+		int kind = 0;
+		while (roll >= fuzz_weights[kind]) {
+			roll -= fuzz_weights[kind++];
+		}
+
+		switch (kind) {
+			case FUZZ_COLOR:        push_chunk(&buffer, &size, &cap, fuzz_insts[fuzz_rand(&rng) % 10]); break;
+			case FUZZ_CLEAR_BUCKET: push_chunk(&buffer, &size, &cap, fuzz_insts[10]); break;
+			case FUZZ_TURN:         push_chunk(&buffer, &size, &cap, fuzz_insts[12 + (fuzz_rand(&rng) % 2)]); break;
+			case FUZZ_MARK:         push_chunk(&buffer, &size, &cap, fuzz_insts[14]); break;
+			case FUZZ_LINE:         push_chunk(&buffer, &size, &cap, fuzz_insts[15]); break;
+			case FUZZ_FILL:         push_chunk(&buffer, &size, &cap, fuzz_insts[16]); break;
+			case FUZZ_ADD_BITMAP:   push_chunk(&buffer, &size, &cap, fuzz_insts[17]); break;
+			case FUZZ_COMPOSE:      push_chunk(&buffer, &size, &cap, fuzz_insts[18]); break;
+			case FUZZ_CLIP:         push_chunk(&buffer, &size, &cap, fuzz_insts[19]); break;
+			case FUZZ_MOVES: {
+				// Long enough to wrap around the edges every so often
+				int moves = 1 + (fuzz_rand(&rng) % ((fuzz_rand(&rng) % 8) ? 60 : 700));
+				for (int j = 0; j < moves; j++) {
+					push_chunk(&buffer, &size, &cap, fuzz_insts[11]);
+				}
+			} break;
+			case FUZZ_JUNK: {
+				char junk[7];
+				for (int j = 0; j < 7; j++) {
+					junk[j] = "ICFP"[fuzz_rand(&rng) % 4];
+				}
+				push_chunk(&buffer, &size, &cap, junk);
+			} break;
+		}
+	}
+
+	buffer[size] = '\0';
+	*rna_size = size;
+	return buffer;
+}
+
+// Fills in what first differs between the two states, or returns false if nothing does
+static bool diff_states(ref_state_t *ref, fuun_state_t *state, bool top_only, char *desc, size_t desc_size) {
+	if (!top_only) {
+		if (ref->pos_x != state->pos_x || ref->pos_y != state->pos_y) {
+			snprintf(desc, desc_size, "pos (%d, %d) vs (%d, %d)", ref->pos_x, ref->pos_y, state->pos_x, state->pos_y);
+			return true;
+		}
+		if (ref->mark_x != state->mark_x || ref->mark_y != state->mark_y) {
+			snprintf(desc, desc_size, "mark (%d, %d) vs (%d, %d)", ref->mark_x, ref->mark_y, state->mark_x, state->mark_y);
+			return true;
+		}
+		if (ref->dir != state->dir) {
+			snprintf(desc, desc_size, "dir %s vs %s", dir_names[ref->dir], dir_names[state->dir]);
+			return true;
+		}
+		if (ref->bucket_len != state->bucket_len) {
+			snprintf(desc, desc_size, "bucket has %d vs %d colors", ref->bucket_len, state->bucket_len);
+			return true;
+		}
+		for (int i = 0; i < ref->bucket_len; i++) {
+			if (ref->bucket[i].c.c != state->bucket[i].c.c || ref->bucket[i].type != state->bucket[i].type) {
+				snprintf(desc, desc_size, "bucket color %d", i);
+				return true;
+			}
+		}
+		if (ref->bitmap_size != state->bitmap_size) {
+			snprintf(desc, desc_size, "%d vs %d bitmaps", ref->bitmap_size, state->bitmap_size);
+			return true;
+		}
+	}
+
+	bool differs = false;
+	color_t *px = (color_t *)emalloc(sizeof(color_t) * BITMAP_WIDTH * BITMAP_HEIGHT);
+	for (int i = 0; i < (top_only ? 1 : ref->bitmap_size) && !differs; i++) {
+		layer_to_rgba(state->bitmaps[i], px);
+		for (int j = 0; j < BITMAP_WIDTH * BITMAP_HEIGHT; j++) {
+			color_t want = ref->bitmaps[i][j];
+			if (px[j].c != want.c) {
+				char want_str[20];
+				strcpy(want_str, print_color(want));
+				snprintf(desc, desc_size, "bitmap %d pixel (%d, %d) is (%s) vs (%s)", i, j % BITMAP_WIDTH, j / BITMAP_WIDTH, want_str, print_color(px[j]));
+				differs = true;
+				break;
+			}
+		}
+	}
+	free(px);
+	return differs;
+}
+
+// Runs both renderers from scratch over the first stop_at instructions and compares what they end up with
+static bool diff_at(char *rna_buffer, size_t rna_size, run_opts_t *opts, int stop_at, int *inst_count, char *desc, size_t desc_size) {
+	ref_state_t ref;
+	int ref_inst_count;
+	ref_run(&ref, &ref_inst_count, rna_buffer, rna_size, stop_at);
+
+	fuun_state_t state;
+	init_state(&state);
+	run_opts_t run_opts = *opts;
+	run_opts.stop_at = stop_at;
+	process_rna(&state, rna_buffer, rna_size, &run_opts);
+
+	// Dead drawing elimination only keeps the final image right
+	bool differs = diff_states(&ref, &state, opts->opt_level >= 2, desc, desc_size);
+	if (!differs && ref_inst_count != state.inst_count) {
+		snprintf(desc, desc_size, "%d vs %d instructions", ref_inst_count, state.inst_count);
+		differs = true;
+	}
+
+	*inst_count = ref_inst_count;
+	free_ref_state(&ref);
+	free_state(&state);
+	return differs;
+}
+
+static bool diff_trace(char *name, char *rna_buffer, size_t rna_size, run_opts_t *opts) {
+	char desc[256];
+	int inst_count;
+	if (!diff_at(rna_buffer, rna_size, opts, -1, &inst_count, desc, sizeof(desc))) {
+		printf("%s: same (%d instructions)\n", name, inst_count);
+		return true;
+	}
+	printf("%s: differs at the end, %s\n", name, desc);
+
+	run_opts_t probe = *opts;
+	probe.opt_level = min(probe.opt_level, 1);
+
+	int probe_count;
+	if (!diff_at(rna_buffer, rna_size, &probe, inst_count, &probe_count, desc, sizeof(desc))) {
+		printf("%s: with -O 1 the whole state matches, so it's from dead drawing elimination\n", name);
+		return false;
+	}
+
+	// Nothing has run at 0, so the states match there
+	int same = 0;
+	int differs = inst_count;
+	while ((differs - same) > 1) {
+		int mid = same + ((differs - same) / 2);
+		if (diff_at(rna_buffer, rna_size, &probe, mid, &probe_count, desc, sizeof(desc))) {
+			differs = mid;
+		} else {
+			same = mid;
+		}
+	}
+	diff_at(rna_buffer, rna_size, &probe, differs, &probe_count, desc, sizeof(desc));
+
+	size_t offset = inst_offset(rna_buffer, rna_size, same);
+	printf("%s: instruction %d (%s at rna offset %zu) first makes them differ, %s\n", name, same, get_inst_name(get_rna_seq(rna_buffer + offset)), offset, desc);
+	return false;
+}
+
+// Returns how many traces the renderers disagree on
+static int run_diff(char **filenames, int file_count, int fuzz_count, uint64_t seed, run_opts_t *opts) {
+	run_opts_t diff_opts = *opts;
+	diff_opts.checkpoint_every = 0;
+	diff_opts.prefix_cache = NULL;
+	diff_opts.snapshots = NULL;
+	diff_opts.frames = NULL;
+	diff_opts.threshold = 0;
+
+	int failures = 0;
+	for (int i = 0; i < file_count; i++) {
+		size_t rna_size;
+		char *rna_buffer = read_file(filenames[i], &rna_size);
+		rna_buffer[rna_size] = '\0';
+
+		if (!diff_trace(filenames[i], rna_buffer, rna_size, &diff_opts)) {
+			failures++;
+		}
+		free(rna_buffer);
+	}
+
+	for (int i = 0; i < fuzz_count; i++) {
+		size_t rna_size;
+		char *rna_buffer = fuzz_rna(seed + i, &rna_size);
+
+		char name[64];
+		snprintf(name, sizeof(name), "fuzz_%llu.rna", (unsigned long long)(seed + i));
+		if (!diff_trace(name, rna_buffer, rna_size, &diff_opts)) {
+			// Keep it around so it can be rerun with any other flags
+			int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1 || write(fd, rna_buffer, rna_size) != (ssize_t)rna_size) {
+				panic("Failed to write %s\n", name);
+			}
+			close(fd);
+			printf("%s: written out\n", name);
+			failures++;
+		}
+		free(rna_buffer);
+	}
+
+	printf("%d of %d traces differ from the reference\n", failures, file_count + fuzz_count);
+	return failures;
+}
+
 char endo_dna_filename[] = "test.rna";
 char endo_img_filename[] = "source.png";
 char dump_filename[] = "dump.png";
+char default_snapshot_dir[] = "snapshots";
+char default_frame_dir[] = "frames";
+char default_batch_dir[] = "batch";
 
-int main() {
-	size_t dna_file_size;
-	char *dna_buffer = read_file(endo_dna_filename, &dna_file_size);
-	dna_buffer[dna_file_size] = '\0';
+#ifdef ENDO_COMPILED_TRACE
+// Comes from the generated file that includes this one
+static void run_compiled_trace(fuun_state_t *state);
+#endif
+
+static void usage(char *prog) {
+	dprintf(2, "usage: %s [-q] [-n inst] [-s snapshot_dir] [-k every] [-f every] [-F] [-o frame_dir] [-i cache_dir] [-O level] [-J] [-p] [-j workers] [-r] [-g] [-L] [-P] [-t] [-V scale] [-T score] [-C out.c] [-D out.txt] [rna_file]\n", prog);
+	dprintf(2, "       %s -b list_or_dir [-d out_dir] [-j workers] [-O level] [-J] [-r] [-L] [-P] [-t] [-V scale] [-T score]\n", prog);
+	dprintf(2, "       %s -x fuzz_count [-S seed] [-O level] [-J] [-p] [-j workers] [-r] [-g] [-L] [-P] [-t] [rna_file...]\n", prog);
+	dprintf(2, "  -q         don't trace every instruction\n");
+	dprintf(2, "  -n inst    stop after inst instructions and dump the top bitmap\n");
+	dprintf(2, "  -s dir     resume from the nearest usable snapshot in dir (default: %s)\n", default_snapshot_dir);
+	dprintf(2, "  -k every   write a snapshot to the snapshot dir every `every` instructions\n");
+	dprintf(2, "  -f every   write a frame of the flattened layers every `every` instructions\n");
+	dprintf(2, "  -F         write a frame after every compose and clip\n");
+	dprintf(2, "  -o dir     where frames go (default: %s), each a complete PNG\n", default_frame_dir);
+	dprintf(2, "  -i dir     cache the state at every %d byte block of rna in dir, keyed by prefix hash,\n", PREFIX_BLOCK_SIZE);
+	dprintf(2, "             and resume from the longest cached prefix (takes priority over -s)\n");
+	dprintf(2, "  -O level   optimize the decoded trace before running it (0: off, 1: fold cursor moves and turns,\n");
+	dprintf(2, "             2: also drop drawing that never reaches the final image,\n");
+	dprintf(2, "             3: also resolve the cursor and colors into a flat list of draws before running)\n");
+	dprintf(2, "  -J         compile the draw list to machine code before running it (x86-64, falls back to -O 3)\n");
+	dprintf(2, "  -p         draw independent bitmaps in parallel on -j workers (runs the draw list like -O 3)\n");
+	dprintf(2, "  -r         cache fill regions and reuse them for fills from the same seed over the same pixels\n");
+	dprintf(2, "  -g         finish fills that get big as bands on -j workers (traced as one line once done)\n");
+	dprintf(2, "  -L         render the draw list on bitmaps stored as runs per row (overrides -J, -p and -P)\n");
+	dprintf(2, "  -P         render the draw list on bitmaps of 16 bit palette indices (overrides -J and -p)\n");
+	dprintf(2, "  -t         decode the trace a block at a time on another thread while running it (-O 1 at most)\n");
+	dprintf(2, "  -V scale   only score the trace, on bitmaps of scale x scale blocks (2 or 4), with -b render\n");
+	dprintf(2, "             and write out only the traces that beat the best score so far\n");
+	dprintf(2, "  -T score   give up on the render as soon as it can't score under score, with -b under the best so far\n");
+	dprintf(2, "  -C file    compile the trace to C in file instead of running it\n");
+	dprintf(2, "  -D file    write the trace's draw list to file, one draw per line, instead of running it\n");
+	dprintf(2, "  -b input   batch render every trace in a directory (*.rna) or listed one per line in a file\n");
+	dprintf(2, "  -d dir     where batch images and scores.txt go (default: %s)\n", default_batch_dir);
+	dprintf(2, "  -j count   worker threads for -b, -p and -g (default: one per cpu)\n");
+	dprintf(2, "  -x count   check the renderer as set up by the other flags against the reference renderer on\n");
+	dprintf(2, "             every rna_file and count fuzzed traces, and bisect to where any of them first differ\n");
+	dprintf(2, "  -S seed    seed for the first fuzzed trace (default: the time)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	run_opts_t opts = {0};
+	opts.stop_at = -1;
+
+	frame_writer_t frames = {0};
+	frames.frame_dir = default_frame_dir;
+
+	char *rna_filename = endo_dna_filename;
+	char *c_filename = NULL;
+	char *draws_filename = NULL;
+
+	char *batch_input = NULL;
+	char *batch_dir = default_batch_dir;
+	int worker_count = cpu_count();
+	bool parallel = false;
+	bool parallel_fills = false;
+
+	int fuzz_count = -1;
+	uint64_t fuzz_seed = (uint64_t)time(NULL);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "qn:s:k:f:Fo:i:O:JC:D:prLPtgV:T:b:d:j:x:S:")) != -1) {
+		switch (opt) {
+			case 'q': {
+				verbose = false;
+			} break;
+			case 'n': {
+				opts.stop_at = atoi(optarg);
+			} break;
+			case 's': {
+				opts.snapshot_dir = optarg;
+			} break;
+			case 'k': {
+				opts.checkpoint_every = atoi(optarg);
+			} break;
+			case 'f': {
+				frames.frame_every = atoi(optarg);
+			} break;
+			case 'F': {
+				frames.frame_on_compose = true;
+			} break;
+			case 'o': {
+				frames.frame_dir = optarg;
+			} break;
+			case 'i': {
+				opts.prefix_cache = optarg;
+			} break;
+			case 'O': {
+				opts.opt_level = atoi(optarg);
+			} break;
+			case 'J': {
+				opts.jit = true;
+			} break;
+			case 'C': {
+				c_filename = optarg;
+			} break;
+			case 'D': {
+				draws_filename = optarg;
+			} break;
+			case 'p': {
+				parallel = true;
+			} break;
+			case 'r': {
+				opts.fill_cache = true;
+			} break;
+			case 'L': {
+				opts.rle = true;
+			} break;
+			case 'P': {
+				opts.palette = true;
+			} break;
+			case 't': {
+				opts.pipeline = true;
+			} break;
+			case 'g': {
+				parallel_fills = true;
+			} break;
+			case 'V': {
+				opts.preview = atoi(optarg);
+			} break;
+			case 'T': {
+				opts.threshold = atoi(optarg);
+			} break;
+			case 'b': {
+				batch_input = optarg;
+			} break;
+			case 'd': {
+				batch_dir = optarg;
+			} break;
+			case 'j': {
+				worker_count = atoi(optarg);
+			} break;
+			case 'x': {
+				fuzz_count = atoi(optarg);
+			} break;
+			case 'S': {
+				fuzz_seed = strtoull(optarg, NULL, 10);
+			} break;
+			default: {
+				usage(argv[0]);
+			}
+		}
+	}
+	if (optind < argc) {
+		rna_filename = argv[optind];
+	}
+	if (worker_count < 1) {
+		panic("-j takes at least 1 worker, not %d\n", worker_count);
+	}
+	if (opts.checkpoint_every && !opts.snapshot_dir) {
+		opts.snapshot_dir = default_snapshot_dir;
+	}
+	if (opts.opt_level >= 2 && (opts.stop_at >= 0 || opts.checkpoint_every || opts.prefix_cache || frames.frame_every || frames.frame_on_compose)) {
+		dprintf(2, "-O %d only keeps the final image right, using -O 1 since intermediate states are wanted\n", opts.opt_level);
+		opts.opt_level = 1;
+	}
+	if (opts.preview && !batch_input && (opts.stop_at >= 0 || opts.snapshot_dir || opts.prefix_cache || frames.frame_every || frames.frame_on_compose || parallel_fills)) {
+		dprintf(2, "-V only scores the whole trace on its own bitmaps, ignoring -n, -s, -k, -i, -f, -F and -g\n");
+		opts.stop_at = -1;
+		opts.snapshot_dir = NULL;
+		opts.checkpoint_every = 0;
+		opts.prefix_cache = NULL;
+		frames.frame_every = 0;
+		frames.frame_on_compose = false;
+		parallel_fills = false;
+	}
+	if (batch_input && (parallel || parallel_fills)) {
+		dprintf(2, "-b already renders traces side by side on the workers, ignoring -p and -g\n");
+		parallel = false;
+		parallel_fills = false;
+	}
+	if (parallel) {
+		opts.parallel = worker_count;
+	}
+	if (parallel_fills) {
+		opts.fill_pool = pool_create(worker_count);
+	}
+	if (opts.preview && opts.preview != 2 && opts.preview != 4) {
+		panic("-V takes 2 or 4, not %d\n", opts.preview);
+	}
+	if ((opts.jit || opts.parallel || opts.rle || opts.palette) && (opts.checkpoint_every || opts.prefix_cache || frames.frame_every || frames.frame_on_compose)) {
+		dprintf(2, "-J, -p, -L and -P can't stop for snapshots or frames, interpreting instead\n");
+		opts.jit = false;
+		opts.parallel = 0;
+		opts.rle = false;
+		opts.palette = false;
+	}
+	if (opts.threshold && (opts.stop_at >= 0 || opts.checkpoint_every || opts.prefix_cache || frames.frame_every || frames.frame_on_compose)) {
+		dprintf(2, "-T only knows where the final image stands, rendering everything since intermediate states are wanted\n");
+		opts.threshold = 0;
+	}
+	if (opts.threshold && (opts.jit || opts.parallel || opts.rle || opts.palette)) {
+		dprintf(2, "-T runs the draw list itself, ignoring -J, -p, -L and -P\n");
+		opts.jit = false;
+		opts.parallel = 0;
+		opts.rle = false;
+		opts.palette = false;
+	}
+	if (opts.pipeline && (opts.opt_level >= 2 || opts.jit || opts.parallel || opts.rle || opts.palette || opts.prefix_cache || opts.threshold)) {
+		dprintf(2, "-O 2 and up, -J, -p, -L, -P, -i and -T want the whole trace decoded at once, not decoding on the side (-t)\n");
+		opts.pipeline = false;
+	}
+
+	if (fuzz_count >= 0) {
+		verbose = false;
+		if (fuzz_count > 0) {
+			printf("Fuzzing from seed %llu\n", (unsigned long long)fuzz_seed);
+		}
+		int differ = run_diff(argv + optind, argc - optind, fuzz_count, fuzz_seed, &opts);
+		if (opts.fill_pool) {
+			pool_destroy(opts.fill_pool);
+		}
+		return differ ? 1 : 0;
+	}
 
 	size_t img_file_size;
 	uint8_t *img_buffer = (uint8_t *)read_file(endo_img_filename, &img_file_size);
@@ -583,16 +6356,113 @@ int main() {
 	int height;
 	int channels;
 	uint8_t *img = stbi_load_from_memory(img_buffer, img_file_size, &width, &height, &channels, 0);
+	if (img == NULL || width != BITMAP_WIDTH || height != BITMAP_HEIGHT || channels < 3) {
+		panic("%s isn't a %dx%d RGB(A) image!\n", endo_img_filename, BITMAP_WIDTH, BITMAP_HEIGHT);
+	}
+	opts.img = img;
+	opts.channels = channels;
+
+	if (batch_input) {
+		verbose = false;
+		run_batch(batch_input, batch_dir, worker_count, &opts, img, channels);
+		return 0;
+	}
+
+	// -V only scores the trace and -T can give up on it, everything after the render still shuts down the same way
+	bool gave_up = false;
+
+#ifdef ENDO_COMPILED_TRACE
+	// The trace was compiled in by a file from -C
+	fuun_state_t state;
+	init_state(&state);
+
+	run_compiled_trace(&state);
+	layer_t *top = state.bitmaps[0];
+#else
+	size_t dna_file_size;
+	char *dna_buffer = read_file(rna_filename, &dna_file_size);
+	dna_buffer[dna_file_size] = '\0';
+
+	if (c_filename || draws_filename) {
+		write_trace(c_filename, draws_filename, rna_filename, dna_buffer, dna_file_size, &opts);
+		return 0;
+	}
+
+	fuun_state_t state;
+	init_state(&state);
+
+	layer_t *top = NULL;
+	snapshot_writer_t snapshots;
+	if (opts.preview) {
+		int inst_count;
+		int score = preview_score(&state, dna_buffer, dna_file_size, opts.preview, img, channels, &inst_count);
+		printf("inst count: %d\n", inst_count);
+		printf("score: %d\n", score);
+	} else {
+		bool resumed = false;
+		if (opts.prefix_cache) {
+			make_dir(opts.prefix_cache);
+			resumed = resume_from_prefix_cache(&state, dna_buffer, dna_file_size, opts.prefix_cache, opts.stop_at);
+		}
+		if (opts.snapshot_dir && !resumed) {
+			resume_from_snapshot(&state, dna_buffer, dna_file_size, opts.snapshot_dir, opts.stop_at);
+		}
+		if (opts.checkpoint_every) {
+			make_dir(opts.snapshot_dir);
+		}
+
+		if (opts.checkpoint_every || opts.prefix_cache) {
+			opts.snapshots = &snapshots;
+			start_snapshot_writer(&snapshots);
+		}
+		if (frames.frame_every || frames.frame_on_compose) {
+			opts.frames = &frames;
+			start_frame_writer(&frames);
+		}
+
+		top = process_rna(&state, dna_buffer, dna_file_size, &opts);
+		gave_up = (top == NULL);
+	}
+#endif
+
+	if (top) {
+		printf("inst count: %d\n", state.inst_count);
+		printf("score: %d\n", score_layer(top, img, channels));
+		if (state.fill_cache) {
+			printf("fill cache: %d hits, %d misses\n", state.fill_cache->hits, state.fill_cache->misses);
+		}
+	}
+
+	if (opts.frames) {
+		finish_frame_writer(opts.frames);
+	}
+	if (opts.snapshots) {
+		finish_snapshot_writer(opts.snapshots);
+	}
+	if (opts.fill_pool) {
+		pool_destroy(opts.fill_pool);
+	}
 
+	if (gave_up) {
+		printf("score: >= %d, gave up\n", opts.threshold);
+	}
+	if (top) {
+		color_t *new_img = (color_t *)emalloc(sizeof(color_t) * BITMAP_WIDTH * BITMAP_HEIGHT);
+		layer_to_rgba(top, new_img);
 
-	char *new_img = (char *)process_rna(dna_buffer, dna_file_size);
+		if (opts.stop_at >= 0) {
+			print_state(&state);
+		}
 
-	printf("Dumping to %s\n", dump_filename);
+		printf("Dumping to %s\n", dump_filename);
 
-	int ret = stbi_write_png(dump_filename, width, height, 4, new_img, width * 4);
-	if (!ret) {
-		panic("failed to write dump file!\n");
+		int ret = stbi_write_png(dump_filename, width, height, 4, new_img, width * 4);
+		if (!ret) {
+			panic("failed to write dump file!\n");
+		}
+		free(new_img);
 	}
 
+	free_state(&state);
 	return 0;
 }